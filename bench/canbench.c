@@ -0,0 +1,516 @@
+/*
+ * Throughput and latency benchmark for CanSerial on a vcan interface
+ *
+ * Runs the bridge in process together with simulated MCU nodes that
+ * answer the UUID handshake and echo every data frame back. Traffic goes
+ * host -> pty -> bus -> node -> bus -> pty -> host, so a round trip
+ * passes CanRxThread twice and the TX thread once per direction.
+ *
+ *  This file may be distributed under the terms of the GNU GPLv3 license.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <termios.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#include "cansock.h"
+#include "histo.h"
+
+#define MAX_NODES 256
+#define MSG_MAX 256
+// Messages in flight per port in bulk mode
+#define BULK_WINDOW 32
+
+enum {
+    MODE_KLIPPER, // ping-pong of small messages on every port
+    MODE_BULK, // stream with a window of messages in flight
+    MODE_IDLE // one busy port among idle nodes
+};
+
+typedef struct {
+    uint8_t uuid[CAN_UUID_SIZE];
+    canid_t canid; // host -> node, 0 while unassigned
+    uint16_t addr; // as PKT_ID_SET gave it, without the flags
+} tNode;
+
+typedef struct {
+    int index;
+    int fd; // pty
+    int inflight;
+    uint64_t msgs;
+} tHost;
+
+static struct {
+    const char *ifname;
+    int nodes;
+    int active;
+    int seconds;
+    int mode;
+    int msglen;
+    int fd;
+    int coalesce_us;
+    int wait; // CAN_WAIT_* of the bridge
+    int spin_us;
+    int eff; // 29 bit port IDs
+    int uring; // bridge on io_uring
+    int shards; // bridge worker threads
+    int profile; // bridge stage profile after the run
+} opt = { "vcan0", 4, 0, 10, MODE_KLIPPER, 24, 0, 0, CAN_WAIT_BLOCK, 0, 0,
+          0, 0, 0 };
+
+static tNode nodes[MAX_NODES];
+static tHost hosts[MAX_NODES];
+static int nodesock;
+static atomic_int stop;
+static atomic_uint_fast64_t nodeframes; // frames seen and sent by nodes
+static tHisto rtt;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Create the interface if needed, that takes root
+static int vcan_up(const char *ifname)
+{
+    char cmd[128];
+
+    if (if_nametoindex(ifname))
+        return 0;
+    snprintf(cmd, sizeof(cmd),
+             "ip link add dev %s type vcan && ip link set %s mtu %d up",
+             ifname, ifname, (int)(opt.fd ? CANFD_MTU : CAN_MTU));
+    if (system(cmd) != 0 || !if_nametoindex(ifname)) {
+        fprintf(stderr, "%s: no such interface and can't create it "
+                "(modprobe vcan, run as root)\n", ifname);
+        return -1;
+    }
+    return 0;
+}
+
+static int node_socket(const char *ifname)
+{
+    struct sockaddr_can addr;
+    int on = 1;
+    int s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+
+    if (s < 0) {
+        perror("node socket");
+        return -1;
+    }
+    if (opt.fd)
+        setsockopt(s, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = if_nametoindex(ifname);
+    if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("node bind");
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+// vcan has a tiny TX queue, wait for room instead of losing the frame
+static void node_send(canid_t id, const uint8_t *data, int len, int fd)
+{
+    struct canfd_frame f;
+    struct pollfd pfd = { nodesock, POLLOUT, 0 };
+
+    memset(&f, 0, sizeof(f));
+    f.can_id = id;
+    f.len = len;
+    if (fd)
+        f.flags = CANFD_BRS;
+    memcpy(f.data, data, len);
+    while (write(nodesock, &f, fd ? CANFD_MTU : CAN_MTU) < 0) {
+        if (errno != ENOBUFS && errno != EAGAIN && errno != EINTR)
+            return;
+        poll(&pfd, 1, 1);
+    }
+    atomic_fetch_add_explicit(&nodeframes, 1, memory_order_relaxed);
+}
+
+static void node_announce(tNode *n)
+{
+    uint8_t resp[CAN_UUID_SIZE + 1];
+
+    memcpy(resp, n->uuid, CAN_UUID_SIZE);
+    resp[CAN_UUID_SIZE] = (opt.fd ? CAN_CAP_FD : 0) |
+        (opt.eff ? CAN_CAP_EFF : 0);
+    node_send(PKT_ID_UUID_RESP, resp, sizeof(resp), 0);
+}
+
+// All simulated nodes share one socket and this thread
+static void *node_thread(void *arg)
+{
+    struct canfd_frame f;
+    struct pollfd pfd = { nodesock, POLLIN, 0 };
+
+    (void)arg;
+    while (!atomic_load(&stop)) {
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+        ssize_t r = read(nodesock, &f, sizeof(f));
+        if (r != CAN_MTU && r != CANFD_MTU)
+            continue;
+        atomic_fetch_add_explicit(&nodeframes, 1, memory_order_relaxed);
+
+        if (f.can_id == PKT_ID_UUID) {
+            uint16_t addr;
+            if (f.len == 0) {
+                // Discovery, everybody without an address answers
+                for (int i = 0; i < opt.nodes; i++)
+                    if (!nodes[i].canid)
+                        node_announce(&nodes[i]);
+            } else if (f.len >= 2) {
+                // Reset of one node, it reboots and announces itself
+                memcpy(&addr, f.data, 2);
+                for (int i = 0; i < opt.nodes; i++) {
+                    if (nodes[i].canid && nodes[i].addr == addr) {
+                        nodes[i].canid = 0;
+                        node_announce(&nodes[i]);
+                    }
+                }
+            }
+        } else if (f.can_id == PKT_ID_SET && f.len >= 2 + CAN_UUID_SIZE) {
+            uint16_t id;
+            memcpy(&id, f.data, 2);
+            for (int i = 0; i < opt.nodes; i++)
+                if (memcmp(nodes[i].uuid, f.data + 2, CAN_UUID_SIZE) == 0)
+                {
+                    nodes[i].addr = id & (PKT_SET_EFF | CAN_MAX_PORT);
+                    nodes[i].canid = id & PKT_SET_EFF ?
+                        CAN_EFF_ID(id & CAN_MAX_PORT) : id & CAN_SFF_MASK;
+                }
+        } else if (f.can_id >= PKT_ID_CTL_FILTER && !(f.can_id & 1)) {
+            // Data or ping for a node, echo it on the slave ID
+            for (int i = 0; i < opt.nodes; i++) {
+                if (nodes[i].canid == f.can_id) {
+                    node_send(f.can_id + 1, f.data, f.len, r == CANFD_MTU);
+                    break;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+// Message: 16 hex digits send time, filler, 0x7E end marker
+static void msg_make(uint8_t *m, uint64_t t)
+{
+    char hex[17];
+
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)t);
+    memcpy(m, hex, 16);
+    memset(m + 16, 'x', opt.msglen - 17);
+    m[opt.msglen - 1] = 0x7E;
+}
+
+static int msg_time(const uint8_t *m, uint64_t *t)
+{
+    char hex[17];
+
+    if (m[opt.msglen - 1] != 0x7E)
+        return -1;
+    memcpy(hex, m, 16);
+    hex[16] = 0;
+    *t = strtoull(hex, NULL, 16);
+    return 0;
+}
+
+static int host_write(tHost *h)
+{
+    uint8_t m[MSG_MAX];
+
+    msg_make(m, now_ns());
+    if (write(h->fd, m, opt.msglen) != opt.msglen)
+        return -1;
+    h->inflight++;
+    return 0;
+}
+
+// Drive all busy ports from one thread with poll, echoes are read back
+// in whole messages
+static void *host_thread(void *arg)
+{
+    struct pollfd pfd[MAX_NODES];
+    uint8_t buf[MAX_NODES][MSG_MAX];
+    int have[MAX_NODES] = {0};
+    int window = opt.mode == MODE_BULK ? BULK_WINDOW : 1;
+    int n = opt.active;
+
+    (void)arg;
+    for (int i = 0; i < n; i++) {
+        pfd[i].fd = hosts[i].fd;
+        pfd[i].events = POLLIN;
+        while (hosts[i].inflight < window)
+            host_write(&hosts[i]);
+    }
+    while (!atomic_load(&stop)) {
+        if (poll(pfd, n, 100) <= 0)
+            continue;
+        for (int i = 0; i < n; i++) {
+            if (!(pfd[i].revents & POLLIN))
+                continue;
+            tHost *h = &hosts[i];
+            ssize_t r = read(h->fd, buf[i] + have[i], opt.msglen - have[i]);
+            if (r <= 0)
+                continue;
+            have[i] += r;
+            if (have[i] < opt.msglen)
+                continue;
+            have[i] = 0;
+            uint64_t t;
+            if (msg_time(buf[i], &t) == 0)
+                HistoRecord(&rtt, now_ns() - t);
+            else
+                fprintf(stderr, "port %d: stream out of sync\n", i);
+            h->msgs++;
+            h->inflight--;
+            while (h->inflight < window)
+                host_write(h);
+        }
+    }
+    return NULL;
+}
+
+static int pty_open(const char *ifname, tNode *n)
+{
+    char bus[IFNAMSIZ], name[64];
+    struct termios ti;
+    int i;
+
+    for (i = 0; ifname[i] && i < IFNAMSIZ - 1; i++)
+        bus[i] = ifname[i] >= 'a' && ifname[i] <= 'z' ?
+            ifname[i] - 'a' + 'A' : ifname[i];
+    bus[i] = 0;
+    snprintf(name, sizeof(name), "/tmp/tty%s_%02x%02x%02x%02x%02x%02x", bus,
+             n->uuid[0], n->uuid[1], n->uuid[2],
+             n->uuid[3], n->uuid[4], n->uuid[5]);
+    int fd = open(name, O_RDWR | O_NOCTTY);
+    if (fd < 0)
+        return -1;
+    tcgetattr(fd, &ti);
+    cfmakeraw(&ti);
+    tcsetattr(fd, TCSANOW, &ti);
+    return fd;
+}
+
+static void *ping_thread(void *arg)
+{
+    tCanCtx *ctx = arg;
+
+    while (!atomic_load(&stop)) {
+        uint64_t next = CanPing(ctx);
+        uint64_t now = now_ns();
+        if (next > now + 100000000ULL)
+            next = now + 100000000ULL;
+        if (next > now)
+            usleep((next - now) / 1000);
+    }
+    return NULL;
+}
+
+static double cpu_seconds(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options]\n"
+            "  -i if      vcan interface, created if missing (default vcan0)\n"
+            "  -n nodes   simulated nodes (default 4)\n"
+            "  -m mode    klipper: ping-pong on every port (default)\n"
+            "             bulk: %d messages in flight per port\n"
+            "             idle: one busy port, all others idle\n"
+            "  -s bytes   message size, 17..%d (default 24)\n"
+            "  -t sec     run time (default 10)\n"
+            "  -c usec    bridge pty coalescing\n"
+            "  -f         CAN FD\n"
+            "  -e         29 bit port IDs\n"
+            "  -S n       bridge ports shared out to n worker threads\n"
+            "  -U         bridge on io_uring\n"
+            "  -W mode[,usec] bridge wait strategy: block, busy or spin\n"
+            "  -x         print the bridge stage profile after the run\n",
+            name, BULK_WINDOW, MSG_MAX);
+}
+
+int main(int argc, char **argv)
+{
+    tCanCfg cfg;
+    tCanCtx *ctx;
+    pthread_t nodeth, hostth, pingth;
+    int c;
+
+    while ((c = getopt(argc, argv, "c:efi:m:n:s:S:t:UW:xh")) != -1) {
+        switch (c) {
+        case 'c': opt.coalesce_us = atoi(optarg); break;
+        case 'e': opt.eff = 1; break;
+        case 'f': opt.fd = 1; break;
+        case 'i': opt.ifname = optarg; break;
+        case 'n': opt.nodes = atoi(optarg); break;
+        case 's': opt.msglen = atoi(optarg); break;
+        case 'S': opt.shards = atoi(optarg); break;
+        case 't': opt.seconds = atoi(optarg); break;
+        case 'U': opt.uring = 1; break;
+        case 'x': opt.profile = 1; break;
+        case 'W':
+            if (strncmp(optarg, "block", 5) == 0)
+                opt.wait = CAN_WAIT_BLOCK;
+            else if (strncmp(optarg, "busy", 4) == 0)
+                opt.wait = CAN_WAIT_BUSYPOLL;
+            else if (strncmp(optarg, "spin", 4) == 0)
+                opt.wait = CAN_WAIT_SPIN;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+            if (strchr(optarg, ','))
+                opt.spin_us = atoi(strchr(optarg, ',') + 1);
+            break;
+        case 'm':
+            if (strcmp(optarg, "bulk") == 0)
+                opt.mode = MODE_BULK;
+            else if (strcmp(optarg, "idle") == 0)
+                opt.mode = MODE_IDLE;
+            else if (strcmp(optarg, "klipper") == 0)
+                opt.mode = MODE_KLIPPER;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opt.nodes < 1 || opt.nodes > MAX_NODES ||
+        opt.msglen < 17 || opt.msglen > MSG_MAX || opt.seconds < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    opt.active = opt.mode == MODE_IDLE ? 1 : opt.nodes;
+
+    if (vcan_up(opt.ifname) < 0 || (nodesock = node_socket(opt.ifname)) < 0)
+        return 1;
+    for (int i = 0; i < opt.nodes; i++) {
+        nodes[i].uuid[0] = 0xBE;
+        nodes[i].uuid[1] = 0x4C;
+        nodes[i].uuid[2] = getpid() >> 8;
+        nodes[i].uuid[3] = getpid();
+        nodes[i].uuid[4] = i >> 8;
+        nodes[i].uuid[5] = i;
+    }
+    HistoReset(&rtt);
+    pthread_create(&nodeth, NULL, node_thread, NULL);
+
+    // The bridge itself, with a throwaway registry and our frames
+    // looped back to the node socket
+    CanCfgDefaults(&cfg);
+    cfg.ifname[0] = opt.ifname;
+    cfg.fd = opt.fd;
+    cfg.loopback = 1;
+    cfg.coalesce_us = opt.coalesce_us;
+    cfg.unixsock = 0;
+    cfg.maxports = opt.nodes;
+    cfg.wait = opt.wait;
+    cfg.uring = opt.uring;
+    cfg.shards = opt.shards;
+    cfg.profile = opt.profile;
+    cfg.id_eff = opt.eff;
+    if (opt.spin_us > 0)
+        cfg.spin_us = opt.spin_us;
+    char registry[64];
+    snprintf(registry, sizeof(registry), "/tmp/canbench-%d.cfg", getpid());
+    cfg.registry = registry;
+    if (CanSockInit(&cfg, &ctx) != 0) {
+        fprintf(stderr, "bridge init failed\n");
+        return 1;
+    }
+    pthread_create(&pingth, NULL, ping_thread, ctx);
+
+    // Wait for every node to get its pty
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < opt.nodes; i++) {
+        while ((hosts[i].fd = pty_open(opt.ifname, &nodes[i])) < 0) {
+            if (now_ns() - t0 > 10000000000ULL) {
+                fprintf(stderr, "node %d got no port\n", i);
+                return 1;
+            }
+            usleep(10000);
+        }
+        hosts[i].index = i;
+    }
+    // Opening a pty resets its node, wait for all to be back
+    for (int i = 0; i < opt.nodes; i++)
+        while (!nodes[i].canid && now_ns() - t0 < 20000000000ULL)
+            usleep(10000);
+    printf("%d nodes up after %.1f ms\n", opt.nodes, (now_ns() - t0) / 1e6);
+
+    uint64_t frames0 = atomic_load(&nodeframes);
+    double cpu0 = cpu_seconds();
+    t0 = now_ns();
+    pthread_create(&hostth, NULL, host_thread, NULL);
+    sleep(opt.seconds);
+    atomic_store(&stop, 1);
+    pthread_join(hostth, NULL);
+    double dt = (now_ns() - t0) / 1e9;
+    double cpu = cpu_seconds() - cpu0;
+    uint64_t frames = atomic_load(&nodeframes) - frames0;
+
+    uint64_t msgs = 0;
+    for (int i = 0; i < opt.active; i++)
+        msgs += hosts[i].msgs;
+    // Every echoed byte crossed the bridge twice
+    double mb = 2.0 * msgs * opt.msglen / 1e6;
+    printf("mode %s nodes %d active %d msg %d bytes%s wait %s%s shards %d\n",
+           opt.mode == MODE_BULK ? "bulk" :
+           opt.mode == MODE_IDLE ? "idle" : "klipper",
+           opt.nodes, opt.active, opt.msglen, opt.fd ? " FD" : "",
+           opt.wait == CAN_WAIT_SPIN ? "spin" :
+           opt.wait == CAN_WAIT_BUSYPOLL ? "busy" : "block",
+           opt.uring ? " io_uring" : "", opt.shards);
+    printf("frames/s %.0f  bytes/s %.0f  msgs/s %.0f\n",
+           frames / dt, mb * 1e6 / dt, msgs / dt);
+    printf("cpu %.1f%%  cpu per MB %.3f s (bridge and simulator)\n",
+           100.0 * cpu / dt, mb > 0 ? cpu / mb : 0);
+    printf("rtt p50 %.1f us  p99 %.1f us  p99.9 %.1f us  max %.1f us\n",
+           HistoPercentile(&rtt, 0.5) / 1e3, HistoPercentile(&rtt, 0.99) / 1e3,
+           HistoPercentile(&rtt, 0.999) / 1e3,
+           atomic_load(&rtt.max) / 1e3);
+    if (opt.profile)
+        CanProfileWrite(ctx, stdout);
+
+    pthread_join(pingth, NULL);
+    for (int i = 0; i < opt.nodes; i++)
+        close(hosts[i].fd);
+    CanSockClose(ctx);
+    pthread_join(nodeth, NULL);
+    unlink(registry);
+    return 0;
+}
@@ -0,0 +1,293 @@
+/*
+ * Replay a CanSerial capture onto a CAN interface
+ *
+ * Reads the pcapng file written with canserial -C and sends the frames
+ * of one captured bus again with their original spacing, or a multiple
+ * of it. By default only what the nodes sent is replayed, so the bridge
+ * under test sees the same node traffic as the captured one. Port
+ * events are printed as they pass.
+ *
+ *  This file may be distributed under the terms of the GNU GPLv3 license.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#define MAX_IFS 16
+#define LINKTYPE_CAN_SOCKETCAN 227
+#define LINKTYPE_USER0 147
+
+#define BLK_SHB 0x0A0D0D0A
+#define BLK_IDB 0x00000001
+#define BLK_EPB 0x00000006
+#define IF_TSRESOL 9
+#define EPB_FLAGS 2
+
+enum { DIR_IN = 1, DIR_OUT = 2, DIR_ALL = 3 };
+
+typedef struct {
+    uint16_t linktype;
+    uint64_t tsdiv; // timestamp units per second
+} tIf;
+
+static struct {
+    const char *ifname;
+    int bus;
+    int dir;
+    double speed; // 0 for as fast as possible
+} opt = { "vcan0", 0, DIR_IN, 1.0 };
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int can_socket(const char *ifname)
+{
+    struct sockaddr_can addr;
+    int s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    int on = 1;
+
+    if (s < 0) {
+        perror("CAN socket");
+        return -1;
+    }
+    setsockopt(s, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = if_nametoindex(ifname);
+    if (addr.can_ifindex == 0 ||
+        bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(ifname);
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+// if_tsresol, power of ten unless the top bit says power of two
+static uint64_t tsdiv_of(uint8_t resol)
+{
+    uint64_t d = 1;
+
+    if (resol & 0x80)
+        return 1ULL << (resol & 0x7F);
+    while (resol--)
+        d *= 10;
+    return d;
+}
+
+static void idb_parse(tIf *ifc, const uint8_t *b, uint32_t len)
+{
+    memcpy(&ifc->linktype, b + 8, 2);
+    ifc->tsdiv = 1000000; // pcapng default, us
+    for (uint32_t o = 16; o + 4 <= len - 4; ) {
+        uint16_t code, olen;
+        memcpy(&code, b + o, 2);
+        memcpy(&olen, b + o + 2, 2);
+        if (code == 0)
+            break;
+        if (code == IF_TSRESOL && olen == 1)
+            ifc->tsdiv = tsdiv_of(b[o + 4]);
+        o += 4 + ((olen + 3) & ~3);
+    }
+}
+
+// Direction from epb_flags, 0 if the block has none
+static int epb_dir(const uint8_t *b, uint32_t len, uint32_t caplen)
+{
+    for (uint32_t o = 28 + ((caplen + 3) & ~3); o + 4 <= len - 4; ) {
+        uint16_t code, olen;
+        memcpy(&code, b + o, 2);
+        memcpy(&olen, b + o + 2, 2);
+        if (code == 0)
+            break;
+        if (code == EPB_FLAGS && olen == 4) {
+            uint32_t flags;
+            memcpy(&flags, b + o + 4, 4);
+            return flags & 3;
+        }
+        o += 4 + ((olen + 3) & ~3);
+    }
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options] capture.pcapng\n"
+            "  -i if      interface to send on (default vcan0)\n"
+            "  -b bus     captured bus to replay, 0 is the first -i of\n"
+            "             canserial (default 0)\n"
+            "  -d dir     in: frames the nodes sent (default), out: frames\n"
+            "             the bridge sent, all: both\n"
+            "  -x factor  speed up by factor, 0 for no pacing (default 1)\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    tIf ifs[MAX_IFS];
+    int nifs = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "b:d:i:x:h")) != -1) {
+        switch (c) {
+        case 'b': opt.bus = atoi(optarg); break;
+        case 'i': opt.ifname = optarg; break;
+        case 'x': opt.speed = atof(optarg); break;
+        case 'd':
+            if (strcmp(optarg, "in") == 0)
+                opt.dir = DIR_IN;
+            else if (strcmp(optarg, "out") == 0)
+                opt.dir = DIR_OUT;
+            else if (strcmp(optarg, "all") == 0)
+                opt.dir = DIR_ALL;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || opt.speed < 0 || opt.bus < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    const uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+
+    int s = can_socket(opt.ifname);
+    if (s < 0)
+        return 1;
+
+    uint64_t first = 0, start = 0, sent = 0, skipped = 0;
+    int started = 0;
+    size_t off = 0;
+    while (off + 12 <= (size_t)st.st_size) {
+        uint32_t type, len;
+        memcpy(&type, map + off, 4);
+        memcpy(&len, map + off + 4, 4);
+        if (len < 12 || (len & 3) || off + len > (size_t)st.st_size) {
+            fprintf(stderr, "truncated block at %zu\n", off);
+            break;
+        }
+        const uint8_t *b = map + off;
+        off += len;
+
+        if (type == BLK_SHB) {
+            uint32_t magic;
+            memcpy(&magic, b + 8, 4);
+            if (magic != 0x1A2B3C4D) {
+                fprintf(stderr, "not a pcapng file of this byte order\n");
+                return 1;
+            }
+            nifs = 0; // interface ids start over per section
+            continue;
+        }
+        if (type == BLK_IDB) {
+            if (nifs < MAX_IFS && len >= 20)
+                idb_parse(&ifs[nifs++], b, len);
+            continue;
+        }
+        if (type != BLK_EPB || len < 32)
+            continue;
+
+        uint32_t ifid, hi, lo, caplen;
+        memcpy(&ifid, b + 8, 4);
+        memcpy(&hi, b + 12, 4);
+        memcpy(&lo, b + 16, 4);
+        memcpy(&caplen, b + 20, 4);
+        if (ifid >= (uint32_t)nifs || 28 + caplen > len)
+            continue;
+        // canserial writes two interfaces per bus, frames then events
+        if (ifid / 2 != (uint32_t)opt.bus)
+            continue;
+        uint64_t ts = (uint64_t)hi << 32 | lo;
+        uint64_t tns = ts / ifs[ifid].tsdiv * 1000000000ULL +
+            ts % ifs[ifid].tsdiv * 1000000000ULL / ifs[ifid].tsdiv;
+        if (!started) {
+            first = tns;
+            start = now_ns();
+            started = 1;
+        }
+        // TX records are stamped after the write, RX ones by the kernel,
+        // so neighbours may be slightly out of order
+        uint64_t rel = tns > first ? tns - first : 0;
+
+        if (opt.speed > 0) {
+            uint64_t at = start + (uint64_t)(rel / opt.speed);
+            struct timespec until = { at / 1000000000ULL, at % 1000000000ULL };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until,
+                                   NULL) == EINTR)
+                ;
+        }
+
+        if (ifs[ifid].linktype == LINKTYPE_USER0) {
+            printf("%10.6f %.*s\n", rel / 1e9, (int)caplen, b + 28);
+            continue;
+        }
+        if (ifs[ifid].linktype != LINKTYPE_CAN_SOCKETCAN ||
+            (caplen != CAN_MTU && caplen != CANFD_MTU))
+            continue;
+        int dir = epb_dir(b, len, caplen);
+        if (dir && !(dir & opt.dir)) {
+            skipped++;
+            continue;
+        }
+
+        struct canfd_frame f;
+        memcpy(&f, b + 28, caplen);
+        f.can_id = ntohl(f.can_id);
+        for (;;) {
+            if (write(s, &f, caplen) == caplen) {
+                sent++;
+                break;
+            }
+            if (errno != ENOBUFS && errno != EINTR) {
+                perror("CAN write");
+                return 1;
+            }
+            // interface queue is full, give it a moment
+            usleep(100);
+        }
+    }
+
+    printf("%llu frames sent, %llu skipped, %.3f s\n",
+           (unsigned long long)sent, (unsigned long long)skipped,
+           started ? (now_ns() - start) / 1e9 : 0.0);
+    munmap((void *)map, st.st_size);
+    close(fd);
+    close(s);
+    return 0;
+}
@@ -6,51 +6,387 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include "cansock.h"
-#include "portnumber.h"
 
-static int running;
+#define STATS_SOCKET "/tmp/canserial.sock"
+// Prometheus textfile refresh, ns
+#define PROM_INTERVAL (5 * 1000000000ULL)
+
+static volatile sig_atomic_t running;
+static volatile sig_atomic_t profile_dump;
 
 static void cleanup_handler(int signo)
 {
-	if (signo == SIGINT) {
-		printf("Received SIGINT\n");
+	if (signo == SIGINT)
 		running = 0;
+	else if (signo == SIGUSR1)
+		profile_dump = 1;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -b bs,stmin ISO-TP bulk channel <port>.bulk with nodes supporting\n"
+		"            it, asking for block size bs and STmin stmin\n"
+		"  -B base[,ports] CAN ID of port 0 and number of ports\n"
+		"            (default 0x180, all standard IDs above it)\n"
+		"  -c usec   coalesce pty bytes into full frames, flush after usec\n"
+		"            (0..1000000)\n"
+		"  -C file   capture bus traffic and port events to pcapng file\n"
+		"  -e        29 bit IDs for all ports, nodes must support it\n"
+		"  -f        use CAN FD data frames with nodes supporting it\n"
+		"  -i if[@cpu] serve CAN interface if, RX thread pinned to cpu,\n"
+		"            repeat for more busses (default can0)\n"
+		"  -I file   ID map: priority class or fixed port by UUID\n"
+		"  -k        credit flow control with nodes supporting it\n"
+		"  -l        keep local loopback of sent frames for candump\n"
+		"  -m        lock all memory, nothing pages on the data path\n"
+		"  -n ports  ports per bus with preallocated buffers (default 64)\n"
+		"  -p msec   ping silent nodes every msec (default 1000)\n"
+		"  -d min,max discovery interval range in msec (default 100,3000)\n"
+		"  -r prio   run the bus threads under SCHED_FIFO at prio\n"
+		"  -S n      share the ports of every bus out to n worker threads\n"
+		"  -u        also serve every port as unix socket <port>.sock\n"
+		"  -U        io_uring for frames and pty writes, epoll if missing\n"
+		"  -w        create ports of known nodes at startup\n"
+		"  -W mode[,usec] wait strategy of the bus threads: block (default),\n"
+		"            busy (SO_BUSY_POLL) or spin, for usec (default 50)\n"
+		"  -x        count time per stage and thread, dumped on SIGUSR1\n"
+		"            or by the profile command\n"
+		"  -t ptys   pty pairs kept ready for new nodes (default 4)\n"
+		"  -s path   stats and control socket (default " STATS_SOCKET "),\n"
+		"            empty to disable\n"
+		"  -P file   keep Prometheus metrics in file (textfile collector)\n"
+		"  -h        this help\n", name);
+}
+
+static void retval_print(FILE *f, int err)
+{
+	if (err)
+		fprintf(f, "error: %s\n", strerror(err));
+	else
+		fprintf(f, "ok\n");
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int stats_open(const char *path)
+{
+	struct sockaddr_un sa;
+	int fd;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path);
+	unlink(path);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+			listen(fd, 4) < 0) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	chmod(path, 0666);
+	return fd;
+}
 
-		CanSockClose();
+/* One command per connection: stats, prom, profile, discover or
+ * drop <port> */
+static void stats_serve(tCanCtx *ctx, int lfd)
+{
+	char cmd[64];
+	struct timeval tv = { 1, 0 };
+	int fd, port;
+	ssize_t n;
+	FILE *f;
+
+	fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+	/* a silent client must not stall the pings */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	n = read(fd, cmd, sizeof(cmd) - 1);
+	if (n <= 0 || (f = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		return;
+	}
+	cmd[n] = 0;
+	cmd[strcspn(cmd, "\r\n")] = 0;
+
+	if (strcmp(cmd, "stats") == 0 || cmd[0] == 0) {
+		CanStatsWrite(ctx, f, 0);
+	} else if (strcmp(cmd, "prom") == 0) {
+		CanStatsWrite(ctx, f, 1);
+	} else if (strcmp(cmd, "profile") == 0) {
+		CanProfileWrite(ctx, f);
+	} else if (strcmp(cmd, "discover") == 0) {
+		CanDiscover(ctx);
+		fprintf(f, "ok\n");
+	} else if (sscanf(cmd, "drop %d", &port) == 1) {
+		retval_print(f, CanPortDrop(ctx, port));
+	} else {
+		fprintf(f, "commands: stats, prom, profile, discover, drop <port>\n");
+	}
+	fclose(f);
+}
+
+static void prom_write(tCanCtx *ctx, const char *path)
+{
+	char tmp[256];
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((f = fopen(tmp, "w")) == NULL) {
+		perror(tmp);
+		return;
 	}
+	CanStatsWrite(ctx, f, 1);
+	if (fclose(f) != 0 || rename(tmp, path) != 0)
+		perror(path);
 }
 
 int main(int argc, char **argv)
 {
 	int retval;
-	int i;
+	int opt;
+	tCanCfg cfg;
+	tCanCtx *ctx;
+	int nbus = 0;
+	char *at;
+	uint64_t next, now, promat = 0;
+	struct timespec ts;
+	const char *stats_path = STATS_SOCKET;
+	const char *prom_path = NULL;
+	struct pollfd pfd;
+	sigset_t usr1, waitmask;
+
+	CanCfgDefaults(&cfg);
+	while ((opt = getopt(argc, argv, "b:B:c:C:d:efi:I:klmn:p:P:r:s:S:t:uUwW:xh")) != -1) {
+		switch (opt) {
+		case 'b':
+			cfg.bulk = 1;
+			cfg.bulk_bs = atoi(optarg);
+			if ((at = strchr(optarg, ',')) != NULL)
+				cfg.bulk_stmin = atoi(at + 1);
+			if (cfg.bulk_bs < 0 || cfg.bulk_bs > 255 ||
+			    cfg.bulk_stmin < 0 || cfg.bulk_stmin > 255) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'W':
+			if (strncmp(optarg, "block", 5) == 0)
+				cfg.wait = CAN_WAIT_BLOCK;
+			else if (strncmp(optarg, "busy", 4) == 0)
+				cfg.wait = CAN_WAIT_BUSYPOLL;
+			else if (strncmp(optarg, "spin", 4) == 0)
+				cfg.wait = CAN_WAIT_SPIN;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+			if ((at = strchr(optarg, ',')) != NULL)
+				cfg.spin_us = atoi(at + 1);
+			if (cfg.spin_us < 1) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'B':
+			cfg.id_base = strtol(optarg, &at, 0);
+			if (*at == ',')
+				cfg.id_ports = atoi(at + 1);
+			if (cfg.id_base < 0 || cfg.id_base > (int)CAN_SFF_MASK - 3 ||
+			    cfg.id_ports < 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'e':
+			cfg.id_eff = 1;
+			break;
+		case 'I':
+			cfg.idmap = optarg;
+			break;
+		case 'c':
+			cfg.coalesce_us = atoi(optarg);
+			// Longer holds stall the node, negative ones never flush
+			if (cfg.coalesce_us < 0 || cfg.coalesce_us > 1000000) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'C':
+			cfg.capture = optarg;
+			break;
+		case 'd':
+			cfg.discover_min_ms = atoi(optarg);
+			if ((at = strchr(optarg, ',')) != NULL)
+				cfg.discover_max_ms = atoi(at + 1);
+			if (cfg.discover_min_ms <= 0 ||
+			    cfg.discover_max_ms < cfg.discover_min_ms) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'f':
+			cfg.fd = 1;
+			break;
+		case 'i':
+			if (nbus == CAN_MAX_BUSES) {
+				fprintf(stderr, "Max %d busses\n", CAN_MAX_BUSES);
+				return 1;
+			}
+			cfg.cpu[nbus] = -1;
+			if ((at = strchr(optarg, '@')) != NULL) {
+				*at = 0;
+				cfg.cpu[nbus] = atoi(at + 1);
+			}
+			cfg.ifname[nbus++] = optarg;
+			cfg.nbus = nbus;
+			break;
+		case 'k':
+			cfg.credit = 1;
+			break;
+		case 'l':
+			cfg.loopback = 1;
+			break;
+		case 'm':
+			cfg.mlock = 1;
+			break;
+		case 'n':
+			cfg.maxports = atoi(optarg);
+			if (cfg.maxports < 1) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'r':
+			cfg.rt_prio = atoi(optarg);
+			if (cfg.rt_prio < 1 || cfg.rt_prio > 99) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 't':
+			cfg.ptypool = atoi(optarg);
+			if (cfg.ptypool < 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'p':
+			cfg.ping_ms = atoi(optarg);
+			if (cfg.ping_ms <= 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 's':
+			stats_path = optarg;
+			break;
+		case 'S':
+			cfg.shards = atoi(optarg);
+			if (cfg.shards < 1 || cfg.shards > CAN_MAX_SHARDS) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'P':
+			prom_path = optarg;
+			break;
+		case 'u':
+			cfg.unixsock = 1;
+			break;
+		case 'U':
+			cfg.uring = 1;
+			break;
+		case 'w':
+			cfg.warm = 1;
+			break;
+		case 'x':
+			cfg.profile = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
 
 	if(signal(SIGINT, cleanup_handler) == SIG_ERR) {
 		fprintf(stderr, "Can't catch SIGINT\n");
 	} else {
 		running = 1;
 	}
+	/* SIGUSR1 only gets through in ppoll, the bus threads inherit
+	 * the mask and never see it */
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	signal(SIGUSR1, cleanup_handler);
+	sigprocmask(SIG_BLOCK, &usr1, &waitmask);
 
-	PnInit();
-
-	if ( (retval = CanSockInit()) != 0) {
+	if ( (retval = CanSockInit(&cfg, &ctx)) != 0) {
 		fprintf(stderr, "Socket init error: %d\n", retval);
-
+		CanSockClose(ctx);
 		return 1;
 	}
 
-	/* send frame */
+	pfd.fd = stats_path[0] ? stats_open(stats_path) : -1;
+	pfd.events = POLLIN;
+
+	/* Wait for the stats socket until the next ping, discovery or
+	 * metrics deadline, SIGINT ends it and SIGUSR1 dumps the profile */
 	while(running)
 	{
-		CanPing();
-		usleep(3000000); /* Delay 3s before next loop */
+		next = CanPing(ctx);
+		now = now_ns();
+		if (prom_path) {
+			if (now >= promat) {
+				prom_write(ctx, prom_path);
+				promat = now + PROM_INTERVAL;
+			}
+			if (promat < next)
+				next = promat;
+		}
+		next = next > now ? next - now : 0;
+		ts.tv_sec = next / 1000000000ULL;
+		ts.tv_nsec = next % 1000000000ULL;
+		pfd.revents = 0;
+		if (ppoll(&pfd, 1, &ts, &waitmask) > 0 && (pfd.revents & POLLIN))
+			stats_serve(ctx, pfd.fd);
+		if (profile_dump) {
+			profile_dump = 0;
+			CanProfileWrite(ctx, stdout);
+			fflush(stdout);
+		}
+	}
+	printf("Received SIGINT\n");
+	if (pfd.fd >= 0) {
+		close(pfd.fd);
+		unlink(stats_path);
 	}
+	CanSockClose(ctx);
 	return 0;
 }
 
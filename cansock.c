@@ -6,63 +6,493 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <errno.h>
+#include <ctype.h>
+#include <time.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <fcntl.h>
 #include <pty.h>
 #include <net/if.h>
 #include <sys/ioctl.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sched.h>
 #include <sys/inotify.h>
+#include <poll.h>
 #include <linux/can.h>
 #include <linux/can/raw.h>
+#include <linux/can/isotp.h>
+#include <linux/can/error.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "cansock.h"
 #include "portnumber.h"
+#include "ringbuf.h"
+#include "txqueue.h"
+#include "capture.h"
+#include "histo.h"
+#include "counter.h"
+#include "uring.h"
+#include "profile.h"
 
 
+// Slot life cycle. Only the bus RX thread changes a slot, other
+// threads may read it through CanPortSnapshot and ask for retirement.
+enum {
+    PORT_FREE = 0,
+    PORT_WARM, // pty made from the registry, node not seen yet
+    PORT_ACTIVE,
+    PORT_RETIRE, // dead, RX thread will close it
+    PORT_PROVISION, // claimed, control worker opens its endpoints
+    PORT_CLOSING // retired, the loop serving it closes its endpoints
+};
+
+// Port counters written by the RX thread
+typedef struct {
+    _Alignas(64) tCounter frames_in; // bus -> host
+    tCounter bytes_in;
+    tCounter drops; // bytes the pty or socket had no room for
+    tCounter bytes_out; // host -> bus, read from pty or socket
+    tCounter frames_queued; // handed to the TX queue
+} tPortRxCnt;
+
 typedef struct {
+    atomic_uint seq; // odd while the RX thread rewrites the slot
+    atomic_int state;
     uint16_t port;
     canid_t canid;
     uint8_t can_uuid[CAN_UUID_SIZE];
-    int pingcount;
+    _Atomic uint64_t lastrx; // last frame from the node, ns
+    uint64_t lastping; // main thread only
     int active; // Is port open
     int watch; // inotify watch
+    int fd; // pty master
+    int sfd; // pty slave, held open so the master never hangs up
+    int fdmode; // data frames are CAN FD
+    int maxlen; // payload bytes per data frame
+    // TX coalescing, bytes from the pty waiting to fill a frame
+    uint8_t stage[CANFD_DATA_SIZE];
+    int stagelen;
+    uint64_t deadline; // flush time of staged bytes, ns
+    // CAN -> pty bytes the pty did not accept yet
+    tRing *rx;
+    int throttled; // pty reads paused until the TX queue drains
+    // Optional SOCK_SEQPACKET endpoint, one datagram per frame
+    int lsock; // listening socket, -1 if none
+    int csock; // connected client, -1 if none
+    tRing *crx; // CAN -> client datagrams not sent yet
+    uint64_t stageat; // read time of the first staged byte, ns
+    // Latency from the kernel RX stamp until the frame was handed to
+    // the pty, socket or callback, recorded by the RX thread
+    tHisto rxlat;
+    // Frames written to the bus and the latency from the pty read
+    // until then, recorded by the TX thread
+    tTxAcct tx;
+    tPortRxCnt rxc;
+    tCounter pingmiss; // pings sent while silent, main thread
+    // Credit flow control, on ports set up with PKT_SET_CREDIT only
+    atomic_int credit;
+    atomic_int txcredit; // bytes the node still takes from us
+    int rxcredit; // bytes granted to the node and not seen yet
+    int cneed; // datagram size the socket client waits to send
+    // ISO-TP bulk channel, on ports set up with PKT_SET_BULK only
+    int tpsock; // CAN_ISOTP socket, -1 if none
+    int tpfd; // tpsock uses CAN FD frames
+    int tpbusy; // a message is being sent, client reads paused
+    int blsock; // listening <pty link>.bulk, -1 if none
+    int bcsock; // its client, -1 if none
+    // Handed to the control worker and back while PORT_PROVISION
+    int provcredit; // node gets credit flow control
+    int provbulk; // bulk channel asked for, then whether it opened
+    int provres; // endpoints opened, -1 if not
+    // Pty writes of the io_uring engine, RX thread. The ring tail only
+    // moves when a write completes.
+    int urwrites; // writes in flight
+    int urblocked; // pty was full, waiting for EPOLLOUT
+    int urqueued; // on the bus list of rings to write out
+    uint32_t urgen; // bumped on close, older completions are stale
 } tPortId;
 
-// p[0] unused and VportFd[0] is the CAN socket
+// The slave address range gives at most PORTS_PER_BUS ports
+#define PORTS_PER_BUS (CAN_MAX_PORT + 1)
+
+// Preallocated slots that never move, so other threads can look at
+// them without a lock. cfg.maxports of them, p[0] unused, zero index
+// means "no port" in portmap
 typedef struct {
     tPortId *p;
-    struct pollfd *VportFd;
-    int portsize; // size of allocated VpostFd vector
-    int portptr;
+    atomic_int portptr; // slots in use are below this
 } tPorts;
 
+// epoll_event.data.u64 layout: source type in the upper half,
+// for EV_PORT the lower half keeps the CAN ID the slave is transmitting on,
+// for EV_TIMER the loop it belongs to, the RX thread 0 and workers from 1
+enum {
+    EV_CAN = 0,
+    EV_INOTIFY,
+    EV_WAKE,
+    EV_TIMER,
+    EV_PORT,
+    EV_LISTEN,
+    EV_CLIENT,
+    EV_ISOTP,
+    EV_BULKLISTEN,
+    EV_BULKCLIENT,
+    EV_SHARD // RX thread queued work for the worker, id is its index
+};
+#define EV_DATA(type, id) (((uint64_t)(type) << 32) | (id))
+#define EV_TYPE(data) ((uint32_t)((data) >> 32))
+#define EV_ID(data) ((uint32_t)(data))
+
+// Stages of cfg.profile, a thread counts those it runs. Pty writes and
+// frame queueing are also part of the stage calling them.
+enum {
+    PROF_POLL = 0, // epoll_wait or io_uring submit, idle time included
+    PROF_FRAMES, // bus frames read and dispatched
+    PROF_PTYWRITE, // frames to ptys and socket clients
+    PROF_PTYREAD, // pty reads into frames
+    PROF_SOCKETS, // seqpacket, ISO-TP and bulk sockets
+    PROF_INOTIFY,
+    PROF_TIMER, // coalescing deadlines
+    PROF_CONTROL, // ports provisioned or retired, queue resumes
+    PROF_QUEUE, // worker running what the RX thread handed over
+    PROF_SEND, // CanSockSend and friends, into the TX queue
+    PROF_TXWAIT, // TX thread waiting for frames
+    PROF_TXWRITE, // sendmmsg, blocks while the qdisc is full
+    PROF_PROVISION, // pty, links and sockets of a new port
+    PROF_SYNC, // registry fsync and pty pool refill
+    PROF_STAGES
+};
+
+static const char *const CanProfNames[PROF_STAGES] = {
+    "poll", "frames", "ptywrite", "ptyread", "sockets", "inotify", "timer",
+    "control", "queue", "send", "txwait", "txwrite", "provision", "sync"
+};
+
+// Stage of every epoll source
+static const uint8_t CanEvStage[] = {
+    [EV_CAN] = PROF_FRAMES,
+    [EV_INOTIFY] = PROF_INOTIFY,
+    [EV_WAKE] = PROF_CONTROL,
+    [EV_TIMER] = PROF_TIMER,
+    [EV_PORT] = PROF_PTYREAD,
+    [EV_LISTEN] = PROF_SOCKETS,
+    [EV_CLIENT] = PROF_SOCKETS,
+    [EV_ISOTP] = PROF_SOCKETS,
+    [EV_BULKLISTEN] = PROF_SOCKETS,
+    [EV_BULKCLIENT] = PROF_SOCKETS,
+    [EV_SHARD] = PROF_QUEUE
+};
+
+// io_uring user_data: operation, and for UR_WRITE the port slot with
+// the urgen it was submitted under
+enum {
+    UR_EPOLL = 1, // the epoll set has events
+    UR_RECV, // multishot recvmsg on the CAN socket
+    UR_WRITE // pty write out of the port ring
+};
+#define UR_DATA(op, slot, gen) \
+    (((uint64_t)(op) << 56) | ((uint64_t)((gen) & 0xFFFFFF) << 32) | (slot))
+#define UR_OP(data) ((int)((data) >> 56))
+#define UR_GEN(data) ((uint32_t)((data) >> 32) & 0xFFFFFF)
+#define UR_SLOT(data) ((uint32_t)(data))
 
 
+
+// Max number of frames moved per recvmmsg call
+#define CAN_RX_BATCH 32
+// Most filters CAN_RAW_FILTER takes, older headers lack it
+#ifndef CAN_RAW_FILTER_MAX
+#define CAN_RAW_FILTER_MAX 512
+#endif
+// Frames taken off the TX queue and kept sorted by the TX thread
+#define CAN_TX_PENDING 64
+// Most bytes granted to a node at a time, half a ring
+#define CREDIT_WINDOW (RING_SIZE / 2)
+// Grant once this much is free, fewer remote frames on the bus
+#define CREDIT_BATCH (4 * CAN_CREDIT_UNIT)
+
+// Bus-off TX retry interval, every try may bring the bus back
+#define BUS_PROBE_MS 100
+// Wait before retrying writes the interface had no room for
+#define TX_RETRY_US 1000
+
+// Provisioning requests in flight over all busses, nodes beyond that
+// are served at their next UUID response
+#define CTL_QUEUE 256
+// Most pty pairs kept open ahead of new ports
+#define PTY_POOL_MAX 32
+
+// Spin window of CAN_WAIT_SPIN and busy poll time of CAN_WAIT_BUSYPOLL
+#define CAN_SPIN_US 50
+
+// Stack of the RX and TX threads when memory is locked
+#define CAN_THREAD_STACK (256 * 1024)
+// Frames per sendmmsg, small enough to let urgent frames overtake
+#define CAN_TX_BATCH 8
+// Stop reading ptys when fewer TX queue entries are left
+#define CAN_TX_HEADROOM (TXQ_SIZE / 8)
+
 #define EVENT_SIZE  ( sizeof (struct inotify_event) )
 #define EVENT_BUF_LEN     ( 1024 * ( EVENT_SIZE + 16 ) )
+#define MAX_EPOLL_EVENTS 64
+// Largest datagram taken from a client, it always fits the TX queue
+// headroom even when cut into classic frames
+#define UNIX_MSG_MAX (CAN_TX_HEADROOM * CAN_DATA_SIZE)
+// Largest pty read, a burst of host output costs one syscall. Classic
+// ports read less, a read always fits the TX queue headroom.
+#define PTY_READ_MAX 4096
+// Room for the SO_TIMESTAMPING control message of one frame
+#define CAN_RX_CTRL CMSG_SPACE(sizeof(struct scm_timestamping))
+// io_uring SQ size, and the CQ size, deep enough for a burst of frames
+// from the multishot receive while the ptys are written
+#define UR_ENTRIES 256
+#define UR_CQ_ENTRIES 1024
+// Provided buffers for the multishot receive, power of two. Each holds
+// the recvmsg header, the timestamp and one frame.
+#define UR_BUFS 64
+#define UR_BUFSIZE ((sizeof(struct io_uring_recvmsg_out) + CAN_RX_CTRL + \
+                     CANFD_MTU + 7) & ~7)
+// Entries of the RX thread -> worker queue, power of two
+#define SHARD_QUEUE 1024
+// Pauses before the RX thread sleeps on a full worker queue, and for
+// how long each time
+#define SHARD_SPINS 128
+#define SHARD_BACKOFF_NS 20000
+
+
+// Written by the TX thread
+typedef struct {
+    _Alignas(64) tCounter frames; // sent
+    tCounter errors; // failed writes
+    tCounter queued_ns; // total time frames spent queued
+    tCounter max_queued_ns;
+    tCounter max_depth;
+    tCounter wakeups;
+    tCounter retries; // writes put off for lack of room
+} tTxStats;
+
+// Written by the RX thread
+typedef struct {
+    _Alignas(64) tCounter frames; // received
+    tCounter errframes;
+    tCounter busoff;
+    tCounter outage_ns; // time spent bus-off
+    tCounter wakeups; // epoll_wait returns, spinning ones only with work
+} tRxStats;
+
+// Work the RX thread hands to the loop serving a port, CanPortRun
+enum {
+    PC_FRAME = 0, // data or credit frame from the node
+    PC_EVENTS, // port went live, watch its endpoints
+    PC_SET, // send PKT_ID_SET, arg holds PC_SET_*
+    PC_ACTIVE, // pty opened (arg 1) or closed (arg 0)
+    PC_RESUME, // TX queue drained, read the throttled ports again
+    PC_CLOSE // close the endpoints and hand the slot back
+};
+#define PC_SET_CREDIT 1
+#define PC_SET_BULK 2 // offer the bulk channel
+#define PC_SET_RESET 4 // node answered again, reopen bulk and take fdmode
+#define PC_SET_FD 8
+
+typedef struct {
+    uint16_t slot;
+    uint8_t op;
+    uint8_t arg;
+    uint64_t stamp; // kernel RX stamp of frame, 0 if unknown
+    tCanFrame frame; // PC_FRAME only, up to its length
+} tShardMsg;
+
+// Worker serving the ports in slots index, index + nshards, ...: their
+// ptys, sockets, rings and coalescing timer. The RX thread only demuxes
+// frames into q, one producer and one consumer, so every port keeps
+// the bus order.
+typedef struct {
+    _Alignas(64) atomic_uint head; // written by the RX thread
+    tCounter drops; // frames q had no room for, RX thread
+    int kick; // pushed to q in this pass, RX thread
+    _Alignas(64) atomic_uint tail; // written by the worker
+    atomic_int sleeping; // worker is in or about to enter epoll_wait
+    atomic_uint epoch; // bumped by every worker pass
+    tCounter wakeups;
+    tCounter msgs; // taken off q
+    tProfile prof; // of the worker
+    tCanBus *b;
+    int index;
+    pthread_t th;
+    int run; // th was started
+    atomic_int exit;
+    int Epoll;
+    int Wakefd;
+    int Timerfd;
+    uint64_t nextdeadline;
+    tShardMsg q[SHARD_QUEUE];
+} tCanShard;
+
+// Everything belonging to one CAN interface, each bus runs its own
+// RX thread and never touches the state of another one
+struct tCanBus {
+    char ifname[IFNAMSIZ];
+    int index;
+    int cpu; // pin RX thread to this core, -1 for any
+    int ifindex;
+    int fd; // interface runs CAN FD
+
+    pthread_t RxTh;
+    pthread_t TxTh;
+
+    atomic_int threadexit;
+    tPorts ports;
+    tRingPool rings; // two per port, RX thread only once it runs
+    int sock;  // The CAN socket
+    // Liveness scheduler state, main thread only
+    uint64_t nextdiscover;
+    uint64_t discover_ns; // current discovery interval
+    atomic_int topology; // ports came or went, discover faster again
+    int Inotify;
+    int Epoll;
+    int Wakefd; // eventfd to kick the RX thread out of epoll_wait
+    int Timerfd; // coalescing deadline timer
+    uint64_t nextdeadline; // deadline Timerfd is armed for, 0 if idle
+    // Port number -> ports index lookup, 0 means no port assigned
+    uint16_t portmap[PORTS_PER_BUS];
+
+    // Frames from all threads go through txq to the TX thread
+    tTxQueue *txq;
+    tTxStats txstats; // written by the TX thread
+    tRxStats rxstats; // written by the RX thread
+    _Atomic uint64_t txdrops; // TX queue full, counted by producers
+    // Last CanStatsWrite sample for the rates, reader only
+    uint64_t statsat, rxwakeups, txwakeups;
+    atomic_int txthrottled; // some port stopped reading its pty
+    atomic_int txresume; // TX queue drained, RX thread resumes ptys
+    atomic_uint rxepoch; // bumped by every RX loop pass
+    atomic_int busstate; // BUS_*, written by the RX thread
+    uint64_t offat; // bus-off since, RX thread
+    tHisto rxdispatch; // kernel RX stamp until CanRxFrame
+    tHisto txqueued; // time frames spent in txq and the heap
+    tProfile rxprof, txprof; // of the RX and TX thread, cfg.profile
+    // Slots the control worker is done with, under ctx->ctllock
+    uint16_t ctldone[CTL_QUEUE];
+    int nctldone;
+    // io_uring engine, RX thread only. Frames come from a multishot
+    // receive and pty writes go out with the next submit, everything
+    // else still arrives through Epoll, polled by the ring.
+    int uring; // running on io_uring, else epoll_wait
+    tUring ur;
+    uint8_t *urbufs; // UR_BUFS provided buffers of UR_BUFSIZE
+    struct msghdr urmsg; // recvmsg layout asked for
+    int urfixed; // rings are registered as fixed buffer 0
+    int urrecv; // multishot receive armed
+    int urpoll; // poll of Epoll armed
+    uint16_t urdirty[PORTS_PER_BUS]; // slots with ring data to write
+    int nurdirty;
+    int urptys; // pty writes go through the ring, not with workers
+    // Workers of cfg.shards, NULL when the RX thread serves all ports
+    tCanShard *shards;
+    int nshards;
+    // Slots their loop closed, freed by the RX thread, under ctx->ctllock
+    uint16_t closed[PORTS_PER_BUS];
+    int nclosed;
+
+    tCanCtx *ctx;
+    const tCanCfg *cfg; // of ctx
+};
+
+// Controller state as told by error frames
+enum {
+    BUS_OK = 0,
+    BUS_PASSIVE, // error passive, still sending
+    BUS_OFF // TX paused and liveness stopped until it comes back
+};
+
+// Where a port lives, bus index << 16 | slot, 0 while unassigned
+#define WHERE(bus, slot) (((bus) << 16) | (slot))
+#define WHERE_BUS(w) ((w) >> 16)
+#define WHERE_SLOT(w) ((w) & 0xFFFF)
+
+// Slot a RX thread claimed and the control worker is to set up
+typedef struct {
+    tCanBus *b;
+    int slot;
+} tCtlReq;
+
+struct tCanCtx {
+    tCanCfg cfg;
+    tCanBus buses[CAN_MAX_BUSES];
+    int nbuses;
+    // By port number, written by the RX threads
+    atomic_int where[CAN_MAX_PORT + 1];
+    // Ports attached through CanPortOpen
+    _Atomic(tCanPort *) hooks[CAN_MAX_PORT + 1];
+    tCapture *cap; // NULL unless cfg.capture
+    // Control worker, opens ptys and sockets of new ports so the RX
+    // threads never wait for the file system
+    pthread_t CtlTh;
+    int ctlrun;
+    pthread_mutex_t ctllock; // ctlq, ctlexit, ctldone and closed of the busses
+    pthread_cond_t ctlcond;
+    tCtlReq ctlq[CTL_QUEUE];
+    unsigned ctlhead, ctltail;
+    int ctlexit;
+    // Pty pairs opened ahead, master and slave
+    pthread_mutex_t ptylock;
+    int ptys[PTY_POOL_MAX][2];
+    int nptys;
+    // cfg.profile, the control worker counts into ctlprof
+    tProfClock profclock;
+    tProfile ctlprof;
+};
+
+struct tCanPort {
+    tCanCtx *ctx;
+    int port;
+    tCanRxCb cb;
+    void *arg;
+};
+
+// Profile of the calling thread, NULL unless cfg.profile
+static _Thread_local tProfile *CanProf;
 
+static inline uint64_t CanProfIn(void) {
+    return CanProf ? ProfTicks() : 0;
+}
 
-static pthread_t RxTh;
-static pthread_mutex_t lock; // protects variables below
+static inline void CanProfOut(int stage, uint64_t t0) {
+    if (CanProf)
+        ProfAdd(CanProf, stage, ProfTicks() - t0);
+}
 
-static int threadexit = 0;
-static tPorts ports;
-static int sock;  // The CAN socket
-static int pingptr = 0;
-static int Inotify;
 
+// /tmp/tty<IFNAME>_<uuid>, can0 keeps the historic /tmp/ttyCAN0_ prefix
+static void CanTtyName(tCanBus *b, tPortId *p, char *name, int maxlen) {
+    char bus[IFNAMSIZ];
+    int i;
 
-static void CanTtyName(tPortId *p, char *name, int maxlen) {
-    // TODO: Name according to CAN bus
-    snprintf(name, maxlen, "/tmp/ttyCAN0_%02x%02x%02x%02x%02x%02x",
+    for (i = 0; b->ifname[i] && i < IFNAMSIZ - 1; i++)
+        bus[i] = toupper((unsigned char)b->ifname[i]);
+    bus[i] = 0;
+    snprintf(name, maxlen, "/tmp/tty%s_%02x%02x%02x%02x%02x%02x",
+             bus,
              p->can_uuid[0],
              p->can_uuid[1],
              p->can_uuid[2],
@@ -71,361 +501,3524 @@ static void CanTtyName(tPortId *p, char *name, int maxlen) {
              p->can_uuid[5]);
 }
 
-static void CanVportClose(tPortId *p) {
-    int res;
+// Slot is live and its loop owns the endpoints, the others belong to
+// the RX thread or the control worker
+static int CanAttached(int state)
+{
+    return state == PORT_WARM || state == PORT_ACTIVE || state == PORT_RETIRE;
+}
 
-    char fname[64];
-    CanTtyName(p, fname, sizeof(fname));
-    inotify_rm_watch(Inotify, p->watch);
-    res = unlink(fname);
-    if (res != 0) {
-        perror(fname);
-    }
+// Worker serving p, NULL if the RX thread does
+static tCanShard *CanShardOf(tCanBus *b, tPortId *p)
+{
+    return b->nshards ? &b->shards[(p - b->ports.p) % b->nshards] : NULL;
 }
 
-static int CanVport(int portid, uint8_t *uuid)
+// Epoll set watching the endpoints of p
+static int CanPortEpoll(tCanBus *b, tPortId *p)
 {
-    int res, i;
-    int fd, sfd;
-    struct termios ti;
+    tCanShard *s = CanShardOf(b, p);
 
-    // check if port exists
-    for(i=1; i<ports.portptr; i++) {
-        if (ports.p[i].port == portid) {
-            // Assign the same virtual port for re-initialized CAN
-            printf("Device reset\n");
-            return i;
-        }
+    return s ? s->Epoll : b->Epoll;
+}
+
+static void CanBulkClose(tCanBus *b, tPortId *p)
+{
+    char fname[80];
+
+    if (p->bcsock >= 0)
+        close(p->bcsock);
+    if (p->tpsock >= 0)
+        close(p->tpsock);
+    if (p->blsock >= 0) {
+        close(p->blsock);
+        CanTtyName(b, p, fname, sizeof(fname));
+        strcat(fname, ".bulk");
+        unlink(fname);
     }
+    p->tpsock = p->blsock = p->bcsock = -1;
+    p->tpbusy = 0;
+}
 
-    if (ports.portptr == ports.portsize) {
-        // Increase allocated space
-        ports.portsize *= 2;
-        ports.p = realloc(ports.p, sizeof(tPortId) * ports.portsize);
-        ports.VportFd = realloc(ports.VportFd, sizeof(struct pollfd) * ports.portsize);
-        if (!ports.p || !ports.VportFd) {
-            fprintf(stderr, "CreatePipe: realloc failed!\n");
-            exit(1);
-        }
+// Client datagrams are read only while the ISO-TP socket is idle
+static void CanBulkEvents(tCanBus *b, tPortId *p)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | (p->tpbusy ? EPOLLOUT : 0);
+    ev.data.u64 = EV_DATA(EV_ISOTP, p->canid + 1);
+    epoll_ctl(CanPortEpoll(b, p), EPOLL_CTL_MOD, p->tpsock, &ev);
+    if (p->bcsock >= 0) {
+        ev.events = p->tpbusy ? 0 : EPOLLIN;
+        ev.data.u64 = EV_DATA(EV_BULKCLIENT, p->canid + 1);
+        epoll_ctl(CanPortEpoll(b, p), EPOLL_CTL_MOD, p->bcsock, &ev);
     }
+}
 
-    tPortId *p = &ports.p[ports.portptr];
+// ISO-TP socket on the bulk IDs of the port and <pty link>.bulk for
+// the host. The kernel does segmentation, flow control and STmin, so
+// a whole message costs one syscall on each side.
+static int CanBulkOpen(tCanBus *b, tPortId *p)
+{
+    struct sockaddr_can addr;
+    struct sockaddr_un sa;
+    struct epoll_event ev;
+    char fname[64];
 
-    // Assign packet handlers
-    p->canid = 2*portid+PKT_ID_CTL_FILTER;
-    memcpy(p->can_uuid, uuid, CAN_UUID_SIZE);
-    p->port = portid;
-    p->pingcount = PINGS_BEFORE_DISCONNECT;
-    p->active = 0;
-    ports.VportFd[ports.portptr].revents = 0;
+    if (p->tpsock >= 0 && p->tpfd == p->fdmode)
+        return 0; // node reset, the host keeps its connection
+    if (p->tpsock >= 0) {
+        epoll_ctl(CanPortEpoll(b, p), EPOLL_CTL_DEL, p->tpsock, NULL);
+        close(p->tpsock);
+        p->tpbusy = 0;
+    }
 
-    // allocate virtual port
-    memset(&ti, 0, sizeof(ti));
-    res = openpty(&fd, &sfd, NULL, &ti, NULL);
-    if (res) {
-        fprintf(stderr, "Error: openpty %d\n", res);
+    p->tpsock = socket(PF_CAN, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                       CAN_ISOTP);
+    if (p->tpsock < 0) {
+        perror("CAN_ISOTP socket"); // can-isotp module missing
+        CanBulkClose(b, p);
         return -1;
     }
-    int flags = fcntl(fd, F_GETFL);
-    if (flags < 0) {
-        fprintf(stderr, "Error: fcntl getfl %d\n", flags);
-        return -1;
+    struct can_isotp_fc_options fc = {
+        .bs = b->cfg->bulk_bs,
+        .stmin = b->cfg->bulk_stmin,
+        .wftmax = 0
+    };
+    setsockopt(p->tpsock, SOL_CAN_ISOTP, CAN_ISOTP_RECV_FC, &fc, sizeof(fc));
+    if (p->fdmode) {
+        struct can_isotp_ll_options ll = {
+            .mtu = CANFD_MTU,
+            .tx_dl = CANFD_DATA_SIZE,
+            .tx_flags = CANFD_BRS
+        };
+        setsockopt(p->tpsock, SOL_CAN_ISOTP, CAN_ISOTP_LL_OPTS, &ll,
+                   sizeof(ll));
     }
-    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-    fcntl(fd, F_SETFD, FD_CLOEXEC);
-    fcntl(sfd, F_SETFD, FD_CLOEXEC);
-
-    char *tname = ttyname(sfd);
-
-    // Create symlink to tty
-    char fname[64];
-    CanTtyName(p, fname, sizeof(fname));
-    unlink(fname);
-    printf("%s CANID %03x\n", fname, p->canid);
-
-    res = symlink(tname, fname);
-    if (res) {
-        fprintf(stderr, "Error: symlink %d\n", res);
+    p->tpfd = p->fdmode;
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = b->ifindex;
+    addr.can_addr.tp.tx_id = CAN_BULK_ID(p->port);
+    addr.can_addr.tp.rx_id = CAN_BULK_ID(p->port) + 1;
+    if (bind(p->tpsock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("CAN_ISOTP bind");
+        CanBulkClose(b, p);
         return -1;
     }
-    res = chmod(tname, 0666);
-    if (res) {
-        fprintf(stderr, "Error: chmod %d\n", res);
+    ev.events = EPOLLIN;
+    ev.data.u64 = EV_DATA(EV_ISOTP, p->canid + 1);
+    epoll_ctl(CanPortEpoll(b, p), EPOLL_CTL_ADD, p->tpsock, &ev);
+
+    if (p->blsock >= 0)
+        return 0;
+    CanTtyName(b, p, fname, sizeof(fname));
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "%s.bulk", fname);
+    unlink(sa.sun_path);
+    p->blsock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                       0);
+    if (p->blsock < 0 ||
+        bind(p->blsock, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+        listen(p->blsock, 1) < 0) {
+        perror(sa.sun_path);
+        CanBulkClose(b, p);
         return -1;
     }
-    ports.VportFd[ports.portptr].fd = fd;
-    ports.VportFd[ports.portptr].events = POLLIN;
+    chmod(sa.sun_path, 0666);
+    ev.events = EPOLLIN;
+    ev.data.u64 = EV_DATA(EV_BULKLISTEN, p->canid + 1);
+    epoll_ctl(CanPortEpoll(b, p), EPOLL_CTL_ADD, p->blsock, &ev);
+    return 0;
+}
 
-    p->watch =
-        inotify_add_watch(Inotify, fname, IN_OPEN|IN_CLOSE);
+// Endpoints of a port, its rings stay until CanVportAbort
+static void CanVportClose(tCanBus *b, tPortId *p) {
+    int res;
 
-    ports.portptr++;
-    return ports.portptr-1;
-}
+    char fname[64];
+    CanTtyName(b, p, fname, sizeof(fname));
+    if (p->fd >= 0) {
+        inotify_rm_watch(b->Inotify, p->watch);
+        res = unlink(fname);
+        if (res != 0) {
+            perror(fname);
+        }
+        epoll_ctl(CanPortEpoll(b, p), EPOLL_CTL_DEL, p->fd, NULL);
+        close(p->fd);
+        close(p->sfd);
+        // Writes still in flight belong to the old pty
+        p->urgen++;
+        p->urwrites = p->urblocked = 0;
+        printf("%s ring hiwater %u drops %llu\n", fname, p->rx->hiwater,
+               (unsigned long long)p->rx->drops);
+    }
+    p->fd = p->sfd = -1;
 
-static int ConfigurePort(tCanFrame frame) {
-    struct __attribute__((__packed__)) {
-        uint16_t canid;
-        uint8_t u[CAN_UUID_SIZE];
-    } resp;
-    // Generate packet id:
-    // (port number*2) + ID offset
-    int portid = PnGetNumber(frame.data);
-    resp.canid = 2*portid+PKT_ID_CTL_FILTER;
-    memcpy(resp.u, frame.data, CAN_UUID_SIZE);
+    if (p->csock >= 0)
+        close(p->csock);
+    if (p->lsock >= 0) {
+        close(p->lsock);
+        strcat(fname, ".sock");
+        unlink(fname);
+        printf("%s ring hiwater %u drops %llu\n", fname, p->crx->hiwater,
+               (unsigned long long)p->crx->drops);
+    }
+    p->lsock = p->csock = -1;
+    CanBulkClose(b, p);
 
-    // allocate virtual port for client
-    printf("UUID %02x:%02x:%02x:%02x:%02x:%02x  ",
-           resp.u[0], resp.u[1], resp.u[2],
-           resp.u[3], resp.u[4], resp.u[5]);
-    CanVport(portid, resp.u);
-    CanSockSend(PKT_ID_SET, sizeof(resp), (uint8_t *)&resp);
-    return 0;
+    char name[80];
+    snprintf(name, sizeof(name), "%s bus->host", fname);
+    HistoPrint(stdout, name, &p->rxlat);
+    snprintf(name, sizeof(name), "%s host->bus", fname);
+    HistoPrint(stdout, name, &p->tx.lat);
 }
 
-void *CanRxThread( void *ptr )
+// Node accepts need more bytes from us, always true without credits
+static int CanCreditLeft(tPortId *p, int need)
 {
-    int i;
-    int ret;
-    tCanFrame frame;
-    uint8_t rxbuf[CAN_DATA_SIZE];
-    char ev_buf[EVENT_BUF_LEN];
+    return !atomic_load_explicit(&p->credit, memory_order_relaxed) ||
+        atomic_load_explicit(&p->txcredit, memory_order_relaxed) >= need;
+}
 
-    pthread_mutex_lock(&lock);
-
-    while (threadexit==0) {
-        pthread_mutex_unlock(&lock);
-        ret = poll(ports.VportFd, ports.portptr, 1000);
-        pthread_mutex_lock(&lock);
-
-        if (ret>0) { // one of fd's ready
-            if (ports.VportFd[0].revents) {
-                // TODO: Should check what event!
-                if(read(ports.VportFd[0].fd, &frame, sizeof(struct can_frame)) >= 0) {
-                    // Configure port
-
-                    if (frame.can_id == PKT_ID_UUID_RESP) {
-                        if (ConfigurePort(frame) < 0) {
-                            fprintf(stderr, "Aborting...\n");
-                            break;
-                        }
-                    } else {
-                        for(i=1; i<ports.portptr; i++) {
-                            if (ports.p[i].canid == (frame.can_id - 1)) {
-                                if (frame.can_dlc > 0 && ports.p[i].active) {
-                                    write(ports.VportFd[i].fd, frame.data, frame.can_dlc);
-                                }
-                                // refresh channel activity
-                                ports.p[i].pingcount = PINGS_BEFORE_DISCONNECT;
-                                break;
-                            }
-                        }
-                        if ( i == ports.portptr) {
-                            printf("An unknown node is using CAN ID 0x%x. Ask for UUID\n", frame.can_id);
-                            // Looks like lost hanshake, try to re-init
-                            uint16_t txaddr = frame.can_id - 1;
-                            CanSockSend(PKT_ID_UUID, 2, (uint8_t*) &(txaddr));
-                        }
-                    }
-                }
-            } else {
-                for(i=1; i<ports.portptr; i++) {
-                    if (ports.VportFd[i].revents) {
-                        ssize_t rl = read (ports.VportFd[i].fd, rxbuf, CAN_DATA_SIZE);
-                        if(rl>0) {
-                            for(int j=0;j<rl;j++) {
-                                if(rxbuf[j] == 0x7E) // End of packet indicator
-                                    ports.p[i].active = 1; // Now we can send responses
-                            }
-                            CanSockSend(ports.p[i].canid, rl, rxbuf);
-                        }
-                    }
-                }
-            }
-        }
-        ssize_t ev = read( Inotify, ev_buf, EVENT_BUF_LEN );
-        if ( ev > 0 ) {
-            for (char *p = ev_buf; p < ev_buf + ev; ) {
-                struct inotify_event *event = (struct inotify_event *) p;
-                for(i=1; i<ports.portptr; i++) {
-                    if(ports.p[i].watch == event->wd) {
-                        if ( event->mask & IN_OPEN ) {
-                            ports.p[i].active = 1;
-                            // Send reset to MCU
-                            CanSockSend(PKT_ID_UUID, 2, (uint8_t*) &(ports.p[i].canid));
-                        } else if ( event->mask & IN_CLOSE ) {
-                            ports.p[i].active = 0;
-                        }
-                        break;
-                    }
-                }
-                p += EVENT_SIZE + event->len;
-            }
-        }
-    }
+// Watch for POLLOUT only while the ring holds data and for POLLIN
+// only while the TX queue has room and the node is there. On io_uring
+// the ring is written from the loop, POLLOUT only after the pty was full.
 
-    // close and delete fd's
-    for(i=1; i<ports.portptr; i++) {
-        printf("close port %d\n", i);
-        CanVportClose(&(ports.p[i]));
+static void CanPortEvents(tCanBus *b, tPortId *p) {
+    struct epoll_event ev;
+    ev.events = 0;
+    if (!p->throttled && atomic_load(&p->state) == PORT_ACTIVE &&
+        CanCreditLeft(p, 1))
+        ev.events |= EPOLLIN;
+    if (RbUsed(p->rx) && (!b->urptys || p->urblocked))
+        ev.events |= EPOLLOUT;
+    ev.data.u64 = EV_DATA(EV_PORT, p->canid + 1);
+    if (p->fd >= 0)
+        epoll_ctl(CanPortEpoll(b, p), EPOLL_CTL_MOD, p->fd, &ev);
+
+    if (p->csock >= 0) {
+        ev.events = 0;
+        if (!p->throttled && atomic_load(&p->state) == PORT_ACTIVE &&
+            CanCreditLeft(p, p->cneed > 1 ? p->cneed : 1))
+            ev.events |= EPOLLIN;
+        if (RbUsed(p->crx))
+            ev.events |= EPOLLOUT;
+        ev.data.u64 = EV_DATA(EV_CLIENT, p->canid + 1);
+        epoll_ctl(CanPortEpoll(b, p), EPOLL_CTL_MOD, p->csock, &ev);
     }
-    pthread_mutex_unlock(&lock);
 }
 
-void CanPing(void)
-{
+// Have the ring of p written out with the next io_uring submit
+static void CanUrQueue(tCanBus *b, tPortId *p) {
+    if (p->urqueued)
+        return;
+    p->urqueued = 1;
+    b->urdirty[b->nurdirty++] = p - b->ports.p;
+}
 
-    pthread_mutex_lock(&lock);
-    if(pingptr == 0) {
-        // request for new port assign
-        CanSockSend(PKT_ID_UUID, 0, NULL);
-        pingptr++;
-        pthread_mutex_unlock(&lock);
+// Forward bus data to the pty, whatever it can't take right now
+// waits in the ring until the pty is writable again. On io_uring all
+// of it goes through the ring, the loop writes it out.
+static void CanPtyWrite(tCanBus *b, tPortId *p, const uint8_t *data, int len) {
+    int was_empty = RbUsed(p->rx) == 0;
+
+    if (b->urptys) {
+        if (RbPut(p->rx, data, len) < 0)
+            CntAdd(&p->rxc.drops, len);
+        else
+            CanUrQueue(b, p);
         return;
     }
 
-    if(pingptr >= ports.portptr) {
-        pingptr=0;
-    } else {
-        // Check if we have packets from remote
-        if(ports.p[pingptr].pingcount == 0) {
-            // Unlink dead port
-            // ToDo: Dirty variant. Need to close /dev/pts first.
-            CanVportClose(&(ports.p[pingptr]));
-            for(int i= pingptr; i<ports.portptr-1; i++) {
-                memcpy(&(ports.p[pingptr]), &(ports.p[pingptr+1]), sizeof(tPortId));
-                memcpy(&(ports.VportFd[pingptr]), &(ports.VportFd[pingptr+1]), sizeof(struct pollfd));
-            }
-            ports.portptr--;
-            pthread_mutex_unlock(&lock);
+    if (was_empty) {
+        ssize_t w = write(p->fd, data, len);
+        if (w == len)
             return;
+        if (w < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                CntAdd(&p->rxc.drops, len);
+                return;
+            }
+            w = 0;
         }
-        ports.p[pingptr].pingcount --;
-        if(ports.p[pingptr].pingcount < 2) {
-            // To reduce bus load we'll send pings only if necessary
-            CanSockSend(ports.p[pingptr].canid, 0, NULL);
-        }
-        pingptr++;
+        data += w;
+        len -= w;
     }
-    
-    pthread_mutex_unlock(&lock);
+    if (RbPut(p->rx, data, len) < 0)
+        CntAdd(&p->rxc.drops, len);
+    if (was_empty && RbUsed(p->rx))
+        CanPortEvents(b, p);
 }
 
-int CanSockInit(void)
-{
-    struct sockaddr_can addr;
-    struct ifreq ifr;
-    struct can_filter *rfilter;
-    int retval;
+// Same for the socket client, but one datagram per frame
+static void CanClientWrite(tCanBus *b, tPortId *p, const uint8_t *data, int len) {
+    int was_empty = RbUsed(p->crx) == 0;
 
-    /* open socket */
-    if ((sock = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
-        return ENOTSOCK;
+    if (was_empty) {
+        if (send(p->csock, data, len, MSG_DONTWAIT | MSG_NOSIGNAL) == len)
+            return;
+        if (errno != EAGAIN && errno != EINTR)
+            return; // the hangup shows up in epoll
     }
+    if (RbPutRec(p->crx, data, len) < 0)
+        CntAdd(&p->rxc.drops, len);
+    if (was_empty && RbUsed(p->crx))
+        CanPortEvents(b, p);
+}
 
-    addr.can_family = AF_CAN;
+static uint64_t CanNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-    strcpy(ifr.ifr_name, "can0");
-    if (ioctl(sock, SIOCGIFINDEX, &ifr) < 0) {
-        return SIOCGIFINDEX;
-    }
-    addr.can_ifindex = ifr.ifr_ifindex;
+// Kernel software RX stamps are CLOCK_REALTIME
+static uint64_t CanRealNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
+static void CanArmTimer(int fd, uint64_t *next, uint64_t deadline) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = deadline / 1000000000ULL;
+    its.it_value.tv_nsec = deadline % 1000000000ULL;
+    timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL);
+    *next = deadline;
+}
 
-    /* enable TX blocking mode when linux can TX buffer is full
-       https://rtime.felk.cvut.cz/can/socketcan-qdisc-final.pdf */
-    int sndbuf = 0;
-    if (setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof (sndbuf)) < 0)
-        perror("setsockopt");
+// Wake the loop serving p up in time for its coalescing deadline
+static void CanPortTimer(tCanBus *b, tPortId *p) {
+    tCanShard *s = CanShardOf(b, p);
+    uint64_t *next = s ? &s->nextdeadline : &b->nextdeadline;
 
-    /* Set filters */
-    rfilter = malloc(sizeof(struct can_filter) * NUM_CAN_FILTERS);
-    if (!rfilter) {
-        return ENOMEM;
+    if (*next == 0 || p->deadline < *next)
+        CanArmTimer(s ? s->Timerfd : b->Timerfd, next, p->deadline);
+}
+
+// Tell the CPU we are spinning, the sibling hyperthread gets to run
+static inline void CanRelax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static void CanWake(tCanBus *b) {
+    uint64_t one = 1;
+    if (write(b->Wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd write");
+}
+
+static void CanShardWake(tCanShard *s) {
+    uint64_t one = 1;
+    if (write(s->Wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd write");
+}
+
+// Next free entry of the worker queue, NULL while it is full. RX thread.
+static tShardMsg *CanShardNext(tCanShard *s) {
+    unsigned head = atomic_load_explicit(&s->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&s->tail, memory_order_acquire) >=
+        SHARD_QUEUE)
+        return NULL;
+    return &s->q[head & (SHARD_QUEUE - 1)];
+}
+
+// Hand the entry of CanShardNext to the worker, it is woken at the end
+// of the pass
+static void CanShardPost(tCanShard *s) {
+    atomic_store_explicit(&s->head,
+        atomic_load_explicit(&s->head, memory_order_relaxed) + 1,
+        memory_order_release);
+    s->kick = 1;
+}
+
+// Wake the workers that got work in this pass and went to sleep, the
+// rest find it before they do
+static void CanShardKick(tCanBus *b) {
+    for (int k = 0; k < b->nshards; k++) {
+        tCanShard *s = &b->shards[k];
+        if (!s->kick)
+            continue;
+        s->kick = 0;
+        // pairs with the store of sleeping before the worker looks at q
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_exchange(&s->sleeping, 0))
+            CanShardWake(s);
     }
-    rfilter[0].can_id = PKT_ID_UUID_FILTER;
-    rfilter[0].can_mask = PKT_ID_UUID_MASK;
-    rfilter[1].can_id = PKT_ID_CTL_FILTER;
-    rfilter[1].can_mask = PKT_ID_CTL_MASK;
+}
 
-    setsockopt(sock, SOL_CAN_RAW, CAN_RAW_FILTER,
-               rfilter, NUM_CAN_FILTERS * sizeof(struct can_filter));
-    free(rfilter);
+static void CanPortRun(tCanBus *b, int i, int op, int arg,
+                       const tCanFrame *frame, uint64_t stamp);
 
-    /* set timeout */
-    struct timeval tv;
-    tv.tv_sec = 1;  // TODO. hmm
-    tv.tv_usec = 0;
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+// Queue op for the worker of slot i, commands wait for room
+static void CanShardCmd(tCanBus *b, int i, int op, int arg) {
+    tCanShard *s = &b->shards[i % b->nshards];
+    tShardMsg *m = CanShardNext(s);
 
-    int rcvbuf_size = 512;	
-    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF,
-                   &rcvbuf_size, sizeof(rcvbuf_size)) < 0) {
-        perror("setsockopt SO_RCVBUF");
-        return 1;
+    // Full, the worker has plenty to do. Spin briefly, then sleep: a
+    // worker sharing the core, or below us with SCHED_FIFO, never runs
+    // while we spin or yield.
+    for (int spins = 0; !m; spins++) {
+        if (spins == 0)
+            CanShardWake(s);
+        if (spins < SHARD_SPINS) {
+            CanRelax();
+        } else {
+            struct timespec ts = { 0, SHARD_BACKOFF_NS };
+            nanosleep(&ts, NULL);
+        }
+        m = CanShardNext(s);
     }
+    m->slot = i;
+    m->op = op;
+    m->arg = arg;
+    CanShardPost(s);
+}
 
-    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        perror("bind");
-        return EIO;
+// Run op on attached slot i where its port is served: right away on
+// the RX thread, else on its worker after everything queued before
+static void CanPortCmd(tCanBus *b, int i, int op, int arg) {
+    if (b->nshards)
+        CanShardCmd(b, i, op, arg);
+    else
+        CanPortRun(b, i, op, arg, NULL, 0);
+}
+
+// CAN ID the host sends to port on, the node answers on the next one
+static canid_t CanPortCanid(const tCanBus *b, int port)
+{
+    if (b->cfg->id_eff)
+        return CAN_EFF_ID(port);
+    return b->cfg->id_base + 2*port;
+}
+
+// Port whose node sends on id, 0 if no node does
+static int CanIdPort(const tCanBus *b, canid_t id)
+{
+    const tCanCfg *cfg = b->cfg;
+
+    if (cfg->id_eff) {
+        if ((id & ~(canid_t)(2*CAN_MAX_PORT + 1)) !=
+            (CAN_EFF_FLAG | PKT_ID_EFF) || !(id & 1))
+            return 0;
+        return (id & (2*CAN_MAX_PORT + 1)) >> 1;
     }
+    if (id > CAN_SFF_MASK || id <= (canid_t)cfg->id_base ||
+        !((id - cfg->id_base) & 1))
+        return 0;
+    int port = (id - cfg->id_base) >> 1;
+    return port <= cfg->id_ports ? port : 0;
+}
 
-    // Allocate ports
-    ports.portsize = 8;
-    ports.portptr = 1; // skip one position for CAN socket
-    ports.p = malloc(sizeof(tPortId) * ports.portsize);
-    ports.VportFd = malloc(sizeof(struct pollfd) * ports.portsize);
-    memset(ports.VportFd, 0, sizeof(struct pollfd) * ports.portsize);
-    if (!ports.p || !ports.VportFd) {
-        fprintf(stderr, "malloc failed!\n");
-        return ENOMEM;
+// Slot of the node sending on rxid, 0 if none
+static int CanSlotOf(const tCanBus *b, canid_t rxid)
+{
+    int i = b->portmap[CanIdPort(b, rxid)];
+
+    return i && b->ports.p[i].canid + 1 == rxid ? i : 0;
+}
+
+// Port address as PKT_ID_SET and PKT_ID_UUID resets carry it
+static uint16_t CanAddr(canid_t canid)
+{
+    if (canid & CAN_EFF_FLAG)
+        return PKT_SET_EFF | ((canid & (2*CAN_MAX_PORT + 1)) >> 1);
+    return canid;
+}
+
+// Make the node holding the address of canid forget it and handshake
+// again
+static void CanPortReset(tCanBus *b, canid_t canid)
+{
+    uint16_t addr = CanAddr(canid);
+    CanSockSend(b, PKT_ID_UUID, 2, (uint8_t *)&addr);
+}
+
+// Kernel side filter: UUID responses plus the exact ID of every live
+// or warm port, so other traffic in the slave address range never wakes us.
+// RX thread only.
+static void CanSetFilters(tCanBus *b)
+{
+    struct can_filter rfilter[1 + PORTS_PER_BUS];
+    int n = 0;
+
+    rfilter[n].can_id = PKT_ID_UUID_FILTER;
+    rfilter[n].can_mask = PKT_ID_UUID_MASK | CAN_EFF_FLAG;
+    n++;
+
+    int ptr = atomic_load(&b->ports.portptr);
+    for (int i = 1; i < ptr; i++) {
+        tPortId *p = &b->ports.p[i];
+        int state = atomic_load(&p->state);
+        if (state != PORT_ACTIVE && state != PORT_WARM)
+            continue;
+        // remote frames are credit grants
+        rfilter[n].can_id = p->canid + 1;
+        rfilter[n].can_mask = CAN_EFF_FLAG |
+            (p->canid & CAN_EFF_FLAG ? CAN_EFF_MASK : CAN_SFF_MASK);
+        n++;
     }
-    ports.VportFd[0].fd = sock;
-    ports.VportFd[0].events = POLLIN;
+    if (n > CAN_RAW_FILTER_MAX) {
+        // Too many for the kernel, one masked filter over the node IDs
+        // of the range instead. Frames of IDs without a live port then
+        // get the reset as before exact filters.
+        canid_t lo = CanPortCanid(b, 1) + 1;
+        canid_t hi = CanPortCanid(b, b->cfg->id_ports) + 1;
+        canid_t idmask = lo & CAN_EFF_FLAG ? CAN_EFF_MASK : CAN_SFF_MASK;
+        canid_t diff = (lo ^ hi) & idmask;
+        canid_t mask = idmask;
+        if (diff)
+            mask &= ~((2U << (31 - __builtin_clz(diff))) - 1);
 
-    // Inotify for port open/close
-    Inotify = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
-    if (Inotify == -1) {
-        fprintf(stderr, "unable to create inotify fd\n");
-        return EINVAL;
+        n = 1;
+        rfilter[n].can_id = lo & (mask | CAN_EFF_FLAG);
+        rfilter[n].can_mask = mask | CAN_EFF_FLAG;
+        n++;
     }
+    if (setsockopt(b->sock, SOL_CAN_RAW, CAN_RAW_FILTER,
+                   rfilter, n * sizeof(struct can_filter)) < 0)
+        perror("setsockopt CAN_RAW_FILTER");
+}
 
-    
-    retval = pthread_mutex_init(&lock, NULL);
-    if (retval)
-        return retval;
-    // Create CAN RX thread
-    retval = pthread_create( &RxTh, NULL, CanRxThread, NULL);
-    if(retval)
-        return retval;
+static int CanPtyNew(int *fd, int *sfd)
+{
+    int res;
+    struct termios ti;
+
+    // allocate virtual port
+    memset(&ti, 0, sizeof(ti));
+    res = openpty(fd, sfd, NULL, &ti, NULL);
+    if (res) {
+        fprintf(stderr, "Error: openpty %d\n", res);
+        return -1;
+    }
+    int flags = fcntl(*fd, F_GETFL);
+    if (flags < 0) {
+        fprintf(stderr, "Error: fcntl getfl %d\n", flags);
+        close(*fd);
+        close(*sfd);
+        return -1;
+    }
+    fcntl(*fd, F_SETFL, flags | O_NONBLOCK);
+    fcntl(*fd, F_SETFD, FD_CLOEXEC);
+    fcntl(*sfd, F_SETFD, FD_CLOEXEC);
     return 0;
 }
 
-void CanSockClose()
+// A pty pair from the pool, a fresh one once it ran dry
+static int CanPtyTake(tCanCtx *ctx, int *fd, int *sfd)
+{
+    pthread_mutex_lock(&ctx->ptylock);
+    if (ctx->nptys > 0) {
+        ctx->nptys--;
+        *fd = ctx->ptys[ctx->nptys][0];
+        *sfd = ctx->ptys[ctx->nptys][1];
+        pthread_mutex_unlock(&ctx->ptylock);
+        return 0;
+    }
+    pthread_mutex_unlock(&ctx->ptylock);
+    return CanPtyNew(fd, sfd);
+}
+
+// Top the pool up to cfg.ptypool, at init and on the control worker
+static void CanPtyFill(tCanCtx *ctx)
 {
-    threadexit = 1;
-    close(sock);
-    pthread_join( RxTh, NULL);
+    int fd, sfd;
+
+    for (;;) {
+        pthread_mutex_lock(&ctx->ptylock);
+        int n = ctx->nptys;
+        pthread_mutex_unlock(&ctx->ptylock);
+        if (n >= ctx->cfg.ptypool || CanPtyNew(&fd, &sfd) < 0)
+            return;
+        pthread_mutex_lock(&ctx->ptylock);
+        ctx->ptys[ctx->nptys][0] = fd;
+        ctx->ptys[ctx->nptys][1] = sfd;
+        ctx->nptys++;
+        pthread_mutex_unlock(&ctx->ptylock);
+    }
 }
 
-int CanSockSend(canid_t id, uint8_t len, uint8_t* data)
+// Pty, symlink and watches for a filled in slot, added to epoll with
+// no events until the port goes live. Runs on the control worker.
+static int CanPtyOpen(tCanBus *b, tPortId *p)
 {
-    tCanFrame frame;
+    int res;
+    int fd, sfd;
+    char tname[64];
+    char fname[64];
+    struct epoll_event ev;
 
-    if (len>8){	
-        fprintf(stderr, "CanSockSend(%d, %d) EINVAL\n", id, len); 
-        return EINVAL;
+    if (CanPtyTake(b->ctx, &fd, &sfd) < 0)
+        return -1;
+    res = ttyname_r(sfd, tname, sizeof(tname));
+    if (res) {
+        fprintf(stderr, "Error: ttyname %d\n", res);
+        goto fail;
     }
-    
-    frame.can_id = id;
-    frame.can_dlc = len;
-    if (len)
-        memcpy(frame.data, data, len);
-    size_t w =  write(sock, &frame, sizeof(frame));
-    if (w != sizeof(frame)) {
-        perror("CAN write");
-        return EIO;
+
+    // Create symlink to tty
+    CanTtyName(b, p, fname, sizeof(fname));
+    unlink(fname);
+    printf("%s CANID %03x%s\n", fname, p->canid, p->fdmode ? " FD" : "");
+
+    res = symlink(tname, fname);
+    if (res) {
+        fprintf(stderr, "Error: symlink %d\n", res);
+        goto fail;
+    }
+    res = chmod(tname, 0666);
+    if (res) {
+        fprintf(stderr, "Error: chmod %d\n", res);
+        goto unlink;
+    }
+
+    p->watch =
+        inotify_add_watch(b->Inotify, fname, IN_OPEN|IN_CLOSE);
+
+    ev.events = 0;
+    ev.data.u64 = EV_DATA(EV_PORT, p->canid + 1);
+    if (epoll_ctl(CanPortEpoll(b, p), EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        goto unwatch;
     }
+    p->fd = fd;
+    p->sfd = sfd;
     return 0;
-}
 
+unwatch:
+    if (p->watch >= 0)
+        inotify_rm_watch(b->Inotify, p->watch);
+    p->watch = -1;
+unlink:
+    unlink(fname);
+fail:
+    close(fd);
+    close(sfd);
+    return -1;
+}
+
+// <pty link>.sock, serves one client at a time
+static void CanUnixOpen(tCanBus *b, tPortId *p)
+{
+    char fname[64];
+    struct epoll_event ev;
+    struct sockaddr_un sa;
+
+    CanTtyName(b, p, fname, sizeof(fname));
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "%s.sock", fname);
+    unlink(sa.sun_path);
+    p->lsock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                      0);
+    if (p->lsock < 0 ||
+        bind(p->lsock, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+        listen(p->lsock, 1) < 0) {
+        perror(sa.sun_path);
+        if (p->lsock >= 0)
+            close(p->lsock);
+        p->lsock = -1;
+        return; // the pty still works
+    }
+    chmod(sa.sun_path, 0666);
+    ev.events = EPOLLIN;
+    ev.data.u64 = EV_DATA(EV_LISTEN, p->canid + 1);
+    epoll_ctl(CanPortEpoll(b, p), EPOLL_CTL_ADD, p->lsock, &ev);
+}
+
+// All endpoints of a port, the pty may be turned off by embedders
+static int CanVportOpen(tCanBus *b, tPortId *p)
+{
+    if (b->cfg->pty && CanPtyOpen(b, p) < 0)
+        return -1;
+    if (b->cfg->unixsock)
+        CanUnixOpen(b, p);
+    return 0;
+}
+
+// Publish a port to CanPortWrite and tell the embedder, RX thread only
+static void CanPortUp(tCanBus *b, int i, int up)
+{
+    tPortId *p = &b->ports.p[i];
+    const tCanCfg *cfg = b->cfg;
+
+    if (p->port > CAN_MAX_PORT)
+        return;
+    atomic_store(&b->ctx->where[p->port], up ? WHERE(b->index, i) : 0);
+    if (b->ctx->cap)
+        CapEvent(b->ctx->cap, b->index, "port %d %s", p->port,
+                 up ? "up" : "down");
+    if (cfg->port_event)
+        cfg->port_event(cfg->event_arg, p->port, p->can_uuid, up);
+}
+
+// A known node answered again, set is PC_SET_* of its answer. RX
+// thread only.
+static void CanVportUpdate(tCanBus *b, int i, int set)
+{
+    tPortId *p = &b->ports.p[i];
+    int warm = atomic_load(&p->state) == PORT_WARM;
+
+    if (warm) {
+        // First answer of a warm started node, serve its pty now
+        printf("Device bound\n");
+        atomic_store(&p->lastrx, CanNow());
+        atomic_store_explicit(&p->state, PORT_ACTIVE,
+                              memory_order_release);
+    } else {
+        // Assign the same virtual port for re-initialized CAN
+        printf("Device reset\n");
+    }
+    // the node may have been reflashed with other capabilities
+    CanPortCmd(b, i, PC_SET, set | PC_SET_RESET);
+    if (warm) {
+        CanPortUp(b, i, 1);
+        atomic_store(&b->topology, 1);
+    }
+}
+
+// Take a free slot and its rings for portid, left in PORT_PROVISION
+// with no endpoints. RX thread only, or before it runs.
+static int CanVportClaim(tCanBus *b, int portid, uint8_t *uuid, int fdmode)
+{
+    int i;
+
+    // Reuse a freed slot or take a fresh one
+    int ptr = atomic_load(&b->ports.portptr);
+    for (i = 1; i < ptr; i++) {
+        if (atomic_load(&b->ports.p[i].state) == PORT_FREE)
+            break;
+    }
+    if (i > b->cfg->maxports) {
+        fprintf(stderr, "%s: no free port slot\n", b->ifname);
+        return -1;
+    }
+
+    tPortId *p = &b->ports.p[i];
+    atomic_fetch_add_explicit(&p->seq, 1, memory_order_acq_rel);
+
+    // Assign packet handlers
+    p->canid = CanPortCanid(b, portid);
+    memcpy(p->can_uuid, uuid, CAN_UUID_SIZE);
+    p->port = portid;
+    atomic_store(&p->lastrx, CanNow());
+    p->lastping = 0;
+    p->active = 0;
+    p->watch = -1;
+    p->fdmode = fdmode;
+    p->maxlen = fdmode ? CANFD_DATA_SIZE : CAN_DATA_SIZE;
+    p->stagelen = 0;
+    p->throttled = 0;
+    p->fd = p->sfd = p->lsock = p->csock = -1;
+    atomic_store(&p->credit, 0);
+    atomic_store(&p->txcredit, 0);
+    p->rxcredit = p->cneed = 0;
+    p->tpsock = p->blsock = p->bcsock = -1;
+    p->tpbusy = 0;
+    p->provcredit = p->provbulk = p->provres = 0;
+    HistoReset(&p->rxlat);
+    HistoReset(&p->tx.lat);
+    memset(&p->rxc, 0, sizeof(p->rxc));
+    CntSet(&p->tx.frames, 0);
+    CntSet(&p->tx.bytes, 0);
+    CntSet(&p->pingmiss, 0);
+    p->rx = RbGet(&b->rings);
+    p->crx = RbGet(&b->rings);
+    if (!p->rx || !p->crx) {
+        fprintf(stderr, "%s: all %d port rings taken\n", b->ifname,
+                b->cfg->maxports);
+        RbRelease(&b->rings, p->rx);
+        RbRelease(&b->rings, p->crx);
+        p->rx = p->crx = NULL;
+        atomic_fetch_add_explicit(&p->seq, 1, memory_order_release);
+        return -1;
+    }
+    // Slave node is transmitting on canid+1, further answers of it
+    // find the slot while it is provisioned
+    b->portmap[portid] = i;
+    if (i == ptr)
+        atomic_store(&b->ports.portptr, ptr + 1);
+    atomic_store_explicit(&p->state, PORT_PROVISION, memory_order_release);
+    atomic_fetch_add_explicit(&p->seq, 1, memory_order_release);
+    return i;
+}
+
+// Hand a claimed slot back, its endpoints must be closed already
+static void CanVportAbort(tCanBus *b, int i)
+{
+    tPortId *p = &b->ports.p[i];
+
+    atomic_fetch_add_explicit(&p->seq, 1, memory_order_acq_rel);
+    RbRelease(&b->rings, p->rx);
+    RbRelease(&b->rings, p->crx);
+    p->rx = p->crx = NULL;
+    b->portmap[p->port] = 0;
+    atomic_store(&p->state, PORT_FREE);
+    atomic_fetch_add_explicit(&p->seq, 1, memory_order_release);
+}
+
+// Endpoints are open, let the port go live. state is PORT_ACTIVE for
+// a node that answered and PORT_WARM for a warm start. The caller
+// updates the filters. RX thread only, or before it runs.
+static void CanVportPublish(tCanBus *b, int i, int state)
+{
+    tPortId *p = &b->ports.p[i];
+
+    atomic_store(&p->lastrx, CanNow());
+    atomic_store_explicit(&p->state, state, memory_order_release);
+    CanPortCmd(b, i, PC_EVENTS, 0);
+    atomic_store(&b->topology, 1);
+    if (state == PORT_ACTIVE)
+        CanPortUp(b, i, 1);
+}
+
+// Claim, open and publish in one go, for warm starts at init
+static int CanVport(tCanBus *b, int portid, uint8_t *uuid, int fdmode,
+                    int state)
+{
+    int i = CanVportClaim(b, portid, uuid, fdmode);
+
+    if (i < 0)
+        return -1;
+    if (CanVportOpen(b, &b->ports.p[i]) < 0) {
+        CanVportClose(b, &b->ports.p[i]);
+        CanVportAbort(b, i);
+        return -1;
+    }
+    CanVportPublish(b, i, state);
+    return i;
+}
+
+// Read canid, data frame mode and state of a slot from any thread,
+// fdmode may be NULL
+static int CanPortSnapshot(tPortId *p, canid_t *canid, int *fdmode)
+{
+    unsigned seq;
+    int state;
+
+    do {
+        seq = atomic_load_explicit(&p->seq, memory_order_acquire);
+        *canid = p->canid;
+        if (fdmode)
+            *fdmode = p->fdmode;
+        state = atomic_load_explicit(&p->state, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) ||
+             seq != atomic_load_explicit(&p->seq, memory_order_relaxed));
+    return state;
+}
+
+// Close ports CanPing found dead and free the slots their loop is done
+// with, RX thread only
+static void CanRetirePorts(tCanBus *b)
+{
+    uint16_t closed[PORTS_PER_BUS];
+    int ptr = atomic_load(&b->ports.portptr);
+    int n;
+
+    for (int i = 1; i < ptr; i++) {
+        if (atomic_load(&b->ports.p[i].state) != PORT_RETIRE)
+            continue;
+        CanPortUp(b, i, 0);
+        atomic_store(&b->ports.p[i].state, PORT_CLOSING);
+        CanPortCmd(b, i, PC_CLOSE, 0);
+    }
+
+    pthread_mutex_lock(&b->ctx->ctllock);
+    n = b->nclosed;
+    memcpy(closed, b->closed, n * sizeof(closed[0]));
+    b->nclosed = 0;
+    pthread_mutex_unlock(&b->ctx->ctllock);
+
+    for (int k = 0; k < n; k++) {
+        tPortId *p = &b->ports.p[closed[k]];
+        CanVportAbort(b, closed[k]);
+        // Its ID is filtered out from now on. Should the node be alive
+        // after all, make it forget the address and handshake again.
+        CanPortReset(b, p->canid);
+    }
+    if (n)
+        CanSetFilters(b);
+}
+
+// Reserve between min and want bytes of the credit the node gave us,
+// 0 if not even min is left. Ports without credits get want.
+static int CanCreditTake(tPortId *p, int min, int want)
+{
+    if (!atomic_load_explicit(&p->credit, memory_order_relaxed))
+        return want;
+    int c = atomic_load_explicit(&p->txcredit, memory_order_relaxed);
+    int n;
+    do {
+        n = c < want ? c : want;
+        if (n < min || n <= 0)
+            return 0;
+    } while (!atomic_compare_exchange_weak_explicit(&p->txcredit, &c, c - n,
+                                                    memory_order_relaxed,
+                                                    memory_order_relaxed));
+    return n;
+}
+
+// Hand back what was reserved and not sent
+static void CanCreditGive(tPortId *p, int n)
+{
+    if (n > 0 && atomic_load_explicit(&p->credit, memory_order_relaxed))
+        atomic_fetch_add_explicit(&p->txcredit, n, memory_order_relaxed);
+}
+
+// Grant the node as much as the pty and socket rings can take, so what
+// it sends is never dropped here. RX thread only.
+static void CanCreditTopUp(tCanBus *b, tPortId *p)
+{
+    static uint8_t none[CAN_DATA_SIZE];
+
+    if (!atomic_load_explicit(&p->credit, memory_order_relaxed))
+        return;
+    int room = CREDIT_WINDOW;
+    if (p->active && p->fd >= 0) {
+        int r = RING_SIZE - RbUsed(p->rx);
+        if (r < room)
+            room = r;
+    }
+    if (p->csock >= 0) {
+        // a record costs a length byte, up to half of it for 1 byte frames
+        int r = (RING_SIZE - RbUsed(p->crx)) / 2;
+        if (r < room)
+            room = r;
+    }
+    int grant = room - p->rxcredit;
+    while (grant >= CREDIT_BATCH) {
+        int n = grant / CAN_CREDIT_UNIT;
+        if (n > CAN_DATA_SIZE)
+            n = CAN_DATA_SIZE;
+        if (CanSockSend(b, p->canid | CAN_RTR_FLAG, n, none) != 0)
+            break;
+        p->rxcredit += n * CAN_CREDIT_UNIT;
+        grant -= n * CAN_CREDIT_UNIT;
+    }
+}
+
+// A PKT_ID_SET went out, start over with no credit on either side
+static void CanCreditStart(tCanBus *b, tPortId *p, int credit)
+{
+    atomic_store(&p->txcredit, 0);
+    p->rxcredit = p->cneed = 0;
+    atomic_store(&p->credit, credit);
+    CanPortEvents(b, p);
+    CanCreditTopUp(b, p);
+}
+
+// Remote frame from a node on its data ID, more bytes it wants from us
+static void CanCreditRx(tCanBus *b, tPortId *p, const tCanFrame *frame)
+{
+    if (!atomic_load_explicit(&p->credit, memory_order_relaxed))
+        return;
+    int len = frame->len > CAN_DATA_SIZE ? CAN_DATA_SIZE : frame->len;
+    int was = atomic_fetch_add_explicit(&p->txcredit, len * CAN_CREDIT_UNIT,
+                                        memory_order_relaxed);
+    // resume reads paused for lack of credit
+    int need = p->cneed > 1 ? p->cneed : 1;
+    if (was < need)
+        CanPortEvents(b, p);
+}
+
+// Hand the node its address, FD, credit and bulk flags included, and
+// start flow control over. RX thread only.
+static void CanPortSet(tCanBus *b, tPortId *p, int credit, int bulk)
+{
+    struct __attribute__((__packed__)) {
+        uint16_t canid;
+        uint8_t u[CAN_UUID_SIZE];
+    } resp;
+
+    resp.canid = CanAddr(p->canid);
+    if (p->fdmode)
+        resp.canid |= PKT_SET_FD;
+    if (credit)
+        resp.canid |= PKT_SET_CREDIT;
+    if (bulk)
+        resp.canid |= PKT_SET_BULK;
+    memcpy(resp.u, p->can_uuid, CAN_UUID_SIZE);
+    CanSockSend(b, PKT_ID_SET, sizeof(resp), (uint8_t *)&resp);
+    // The node keeps its address over a reset but not its credits
+    CanCreditStart(b, p, credit);
+}
+
+// PC_SET on the loop serving p, set holds PC_SET_*
+static void CanPortSetup(tCanBus *b, tPortId *p, int set)
+{
+    int bulk = (set & PC_SET_BULK) != 0;
+
+    if (set & PC_SET_RESET) {
+        int fdmode = (set & PC_SET_FD) != 0;
+        atomic_fetch_add_explicit(&p->seq, 1, memory_order_acq_rel);
+        p->fdmode = fdmode;
+        p->maxlen = fdmode ? CANFD_DATA_SIZE : CAN_DATA_SIZE;
+        atomic_fetch_add_explicit(&p->seq, 1, memory_order_release);
+        if (bulk && CanBulkOpen(b, p) != 0)
+            bulk = 0;
+        if (!bulk)
+            CanBulkClose(b, p);
+    }
+    CanPortSet(b, p, (set & PC_SET_CREDIT) != 0, bulk);
+}
+
+// Queue a claimed slot for the control worker, -1 if it is swamped
+static int CanCtlQueue(tCanBus *b, int slot)
+{
+    tCanCtx *ctx = b->ctx;
+    int res = -1;
+
+    pthread_mutex_lock(&ctx->ctllock);
+    if (ctx->ctlhead - ctx->ctltail < CTL_QUEUE) {
+        ctx->ctlq[ctx->ctlhead++ % CTL_QUEUE] = (tCtlReq){ b, slot };
+        pthread_cond_signal(&ctx->ctlcond);
+        res = 0;
+    }
+    pthread_mutex_unlock(&ctx->ctllock);
+    return res;
+}
+
+// Open the endpoints of a claimed slot and tell its RX thread
+static void CanProvision(tCanBus *b, int i)
+{
+    tPortId *p = &b->ports.p[i];
+
+    p->provres = CanVportOpen(b, p);
+    // Offer bulk only once its socket is there, without the kernel
+    // module the node just goes without
+    if (p->provres == 0 && p->provbulk)
+        p->provbulk = CanBulkOpen(b, p) == 0;
+    pthread_mutex_lock(&b->ctx->ctllock);
+    b->ctldone[b->nctldone++] = i;
+    pthread_mutex_unlock(&b->ctx->ctllock);
+    CanWake(b);
+}
+
+// Everything that may sleep on the file system when a node shows up:
+// pty, symlink, sockets, registry fsync. The RX threads go on
+// forwarding meanwhile.
+static void *CanCtlThread(void *ptr)
+{
+    tCanCtx *ctx = ptr;
+
+    if (ctx->cfg.profile)
+        CanProf = &ctx->ctlprof;
+    for (;;) {
+        pthread_mutex_lock(&ctx->ctllock);
+        while (ctx->ctlhead == ctx->ctltail && !ctx->ctlexit)
+            pthread_cond_wait(&ctx->ctlcond, &ctx->ctllock);
+        if (ctx->ctlexit) {
+            pthread_mutex_unlock(&ctx->ctllock);
+            break;
+        }
+        tCtlReq r = ctx->ctlq[ctx->ctltail++ % CTL_QUEUE];
+        int more = ctx->ctlhead != ctx->ctltail;
+        pthread_mutex_unlock(&ctx->ctllock);
+
+        uint64_t t0 = CanProfIn();
+        CanProvision(r.b, r.slot);
+        CanProfOut(PROF_PROVISION, t0);
+        if (!more) {
+            // Burst is over, persist new nodes and refill the pool
+            t0 = CanProfIn();
+            PnSync();
+            CanPtyFill(ctx);
+            CanProfOut(PROF_SYNC, t0);
+        }
+    }
+    return NULL;
+}
+
+// Bring up what the control worker provisioned with one filter update
+// for the batch. RX thread only.
+static void CanCtlDone(tCanBus *b)
+{
+    uint16_t done[CTL_QUEUE];
+    int n, up = 0;
+
+    pthread_mutex_lock(&b->ctx->ctllock);
+    n = b->nctldone;
+    memcpy(done, b->ctldone, n * sizeof(done[0]));
+    b->nctldone = 0;
+    pthread_mutex_unlock(&b->ctx->ctllock);
+
+    for (int k = 0; k < n; k++) {
+        tPortId *p = &b->ports.p[done[k]];
+        if (p->provres < 0) {
+            CanVportClose(b, p);
+            CanVportAbort(b, done[k]);
+            continue;
+        }
+        CanVportPublish(b, done[k], PORT_ACTIVE);
+        up++;
+    }
+    if (!up)
+        return;
+    // Filters first, the nodes talk right after their SET
+    CanSetFilters(b);
+    for (int k = 0; k < n; k++) {
+        tPortId *p = &b->ports.p[done[k]];
+        if (atomic_load(&p->state) == PORT_ACTIVE)
+            CanPortCmd(b, done[k], PC_SET,
+                       (p->provcredit ? PC_SET_CREDIT : 0) |
+                       (p->provbulk ? PC_SET_BULK : 0));
+    }
+}
+
+static int ConfigurePort(tCanBus *b, tCanFrame *frame) {
+    if (frame->len < CAN_UUID_SIZE)
+        return 0;
+    // Optional capability byte after the UUID, FD data frames are
+    // used only if both sides can do it
+    int fdmode = b->fd && frame->len > CAN_UUID_SIZE &&
+        (frame->data[CAN_UUID_SIZE] & CAN_CAP_FD);
+    if (b->cfg->id_eff && (frame->len <= CAN_UUID_SIZE ||
+                           !(frame->data[CAN_UUID_SIZE] & CAN_CAP_EFF))) {
+        // it would take the port number in the address for an ID
+        fprintf(stderr, "%s: node without 29 bit ID support ignored\n",
+                b->ifname);
+        return 0;
+    }
+    int credit = b->cfg->credit && frame->len > CAN_UUID_SIZE &&
+        (frame->data[CAN_UUID_SIZE] & CAN_CAP_CREDIT);
+    int bulk = b->cfg->bulk && frame->len > CAN_UUID_SIZE &&
+        (frame->data[CAN_UUID_SIZE] & CAN_CAP_BULK);
+    // Generate packet id:
+    // (port number*2) + ID offset
+    int portid = PnGetNumber(frame->data, b->ifname);
+    if (portid < 0) {
+        fprintf(stderr, "No port number left for a new node\n");
+        return 0;
+    }
+
+    // allocate virtual port for client
+    uint8_t *u = frame->data;
+    printf("UUID %02x:%02x:%02x:%02x:%02x:%02x  ",
+           u[0], u[1], u[2], u[3], u[4], u[5]);
+    int i = b->portmap[portid];
+    if (!i) {
+        // The control worker opens its endpoints, CanCtlDone sends
+        // the SET once they are there
+        printf("New device\n");
+        i = CanVportClaim(b, portid, u, fdmode);
+        if (i < 0)
+            return 0;
+        b->ports.p[i].provcredit = credit;
+        b->ports.p[i].provbulk = bulk;
+        if (CanCtlQueue(b, i) < 0) {
+            fprintf(stderr, "%s: provisioning queue full\n", b->ifname);
+            CanVportAbort(b, i);
+        }
+        return 0;
+    }
+    int state = atomic_load(&b->ports.p[i].state);
+    if (state == PORT_PROVISION || state == PORT_CLOSING) {
+        // Answered again while its endpoints are being made, or closed.
+        // A closed one is reset once its slot is free.
+        printf("Device pending\n");
+        return 0;
+    }
+    if (memcmp(b->ports.p[i].can_uuid, u, CAN_UUID_SIZE) != 0) {
+        // The registry gave a pinned node the port of a live one. The
+        // holder is closed and reset, then asks for its new port, the
+        // pinned node gets the slot with the next discovery.
+        printf("Port %d taken over\n", portid);
+        atomic_store(&b->ports.p[i].state, PORT_RETIRE);
+        atomic_store(&b->topology, 1);
+        CanRetirePorts(b);
+        return 0;
+    }
+    CanVportUpdate(b, i, (fdmode ? PC_SET_FD : 0) |
+                   (credit ? PC_SET_CREDIT : 0) | (bulk ? PC_SET_BULK : 0));
+    return 0;
+}
+
+static const char *const busstates[] = { "ok", "passive", "off" };
+
+// All ports of the bus in one go: a broadcast for nodes that lost their
+// address and a ping for those that kept it. RX thread.
+static void CanBusRejoin(tCanBus *b)
+{
+    canid_t canid;
+
+    CanSockSend(b, PKT_ID_UUID, 0, NULL);
+    int ptr = atomic_load(&b->ports.portptr);
+    for (int i = 1; i < ptr; i++) {
+        if (CanPortSnapshot(&b->ports.p[i], &canid, NULL) == PORT_ACTIVE)
+            CanSockSend(b, canid, 0, NULL);
+    }
+    atomic_store(&b->topology, 1);
+}
+
+static void CanBusState(tCanBus *b, int state)
+{
+    int old = atomic_load(&b->busstate);
+    uint64_t now = CanNow();
+
+    if (old == state || (old == BUS_OFF && state == BUS_PASSIVE))
+        return;
+    printf("%s: bus %s\n", b->ifname, busstates[state]);
+    if (b->ctx->cap)
+        CapEvent(b->ctx->cap, b->index, "bus %s", busstates[state]);
+    if (state == BUS_OFF) {
+        CntAdd(&b->rxstats.busoff, 1);
+        b->offat = now;
+    } else if (old == BUS_OFF) {
+        // Nobody could talk, so liveness stood still meanwhile. Shift it
+        // before CanBusPing sees the bus up again.
+        uint64_t outage = now - b->offat;
+        int ptr = atomic_load(&b->ports.portptr);
+        for (int i = 1; i < ptr; i++)
+            atomic_fetch_add_explicit(&b->ports.p[i].lastrx, outage,
+                                      memory_order_relaxed);
+        CntAdd(&b->rxstats.outage_ns, outage);
+    }
+    atomic_store(&b->busstate, state);
+    if (old == BUS_OFF)
+        CanBusRejoin(b);
+}
+
+static void CanBusError(tCanBus *b, const tCanFrame *f)
+{
+    if (f->can_id & CAN_ERR_BUSOFF) {
+        CanBusState(b, BUS_OFF);
+    } else if (f->can_id & CAN_ERR_RESTARTED) {
+        CanBusState(b, BUS_OK);
+    } else if (f->can_id & CAN_ERR_CRTL) {
+        if (f->data[1] & (CAN_ERR_CRTL_RX_PASSIVE | CAN_ERR_CRTL_TX_PASSIVE))
+            CanBusState(b, BUS_PASSIVE);
+        else if (f->data[1] & CAN_ERR_CRTL_ACTIVE)
+            CanBusState(b, BUS_OK);
+    }
+}
+
+// Data from the node to the host, on the loop serving p
+static void CanRxData(tCanBus *b, tPortId *p, const tCanFrame *frame,
+                      uint64_t rxstamp)
+{
+    if (frame->len == 0)
+        return;
+    uint64_t t0 = CanProfIn();
+    if (p->active)
+        CanPtyWrite(b, p, frame->data, frame->len);
+    if (p->csock >= 0)
+        CanClientWrite(b, p, frame->data, frame->len);
+    CanProfOut(PROF_PTYWRITE, t0);
+    tCanPort *h = p->port <= CAN_MAX_PORT ?
+        atomic_load_explicit(&b->ctx->hooks[p->port], memory_order_acquire) :
+        NULL;
+    if (h)
+        h->cb(h->arg, frame->data, frame->len);
+    CntAdd(&p->rxc.frames_in, 1);
+    CntAdd(&p->rxc.bytes_in, frame->len);
+    if (rxstamp)
+        HistoRecord(&p->rxlat, CanRealNow() - rxstamp);
+    if (atomic_load_explicit(&p->credit, memory_order_relaxed)) {
+        p->rxcredit -= frame->len;
+        if (p->rxcredit < 0)
+            p->rxcredit = 0; // node overran its credit
+        CanCreditTopUp(b, p);
+    }
+}
+
+static void CanPortRun(tCanBus *b, int i, int op, int arg,
+                       const tCanFrame *frame, uint64_t stamp)
+{
+    tPortId *p = &b->ports.p[i];
+
+    switch (op) {
+    case PC_FRAME:
+        if (frame->can_id & CAN_RTR_FLAG)
+            CanCreditRx(b, p, frame);
+        else
+            CanRxData(b, p, frame, stamp);
+        break;
+    case PC_EVENTS:
+        CanPortEvents(b, p);
+        break;
+    case PC_SET:
+        CanPortSetup(b, p, arg);
+        break;
+    case PC_ACTIVE:
+        p->active = arg;
+        if (!arg)
+            CanCreditTopUp(b, p);
+        break;
+    case PC_CLOSE:
+        // Unlink dead port
+        // ToDo: Dirty variant. Need to close /dev/pts first.
+        CanVportClose(b, p);
+        p->stagelen = 0;
+        pthread_mutex_lock(&b->ctx->ctllock);
+        b->closed[b->nclosed++] = i;
+        pthread_mutex_unlock(&b->ctx->ctllock);
+        if (b->nshards)
+            CanWake(b);
+        break;
+    }
+}
+
+// Frame of the node in slot i to the loop serving it. A worker that
+// falls a queue behind loses frames, like a full pty ring does.
+static void CanPortFrame(tCanBus *b, int i, const tCanFrame *frame,
+                         uint64_t stamp)
+{
+    if (!CanAttached(atomic_load_explicit(&b->ports.p[i].state,
+                                          memory_order_relaxed)))
+        return; // no endpoints yet or any more
+    if (frame->len == 0)
+        return; // a ping answer, lastrx is all it carries
+    if (!b->nshards) {
+        CanPortRun(b, i, PC_FRAME, 0, frame, stamp);
+        return;
+    }
+    tCanShard *s = &b->shards[i % b->nshards];
+    tShardMsg *m = CanShardNext(s);
+    if (!m) {
+        CntAdd(&s->drops, 1);
+        return;
+    }
+    m->slot = i;
+    m->op = PC_FRAME;
+    m->stamp = stamp;
+    memcpy(&m->frame, frame, offsetof(tCanFrame, data) + frame->len);
+    CanShardPost(s);
+}
+
+// rxstamp is the kernel receive time, 0 if unknown
+static void CanRxFrame(tCanBus *b, tCanFrame *frame, uint64_t rxstamp)
+{
+    int i;
+
+    if (rxstamp)
+        HistoRecord(&b->rxdispatch, CanRealNow() - rxstamp);
+    CntAdd(&b->rxstats.frames, 1);
+
+    if (frame->can_id & CAN_ERR_FLAG) {
+        CntAdd(&b->rxstats.errframes, 1);
+        CanBusError(b, frame);
+        return;
+    }
+    // Anything heard means the controller is back on the bus
+    if (atomic_load_explicit(&b->busstate, memory_order_relaxed) == BUS_OFF)
+        CanBusState(b, BUS_OK);
+
+    if (frame->can_id == PKT_ID_UUID_RESP) {
+        // Configure port
+        ConfigurePort(b, frame);
+        return;
+    }
+
+    i = CanSlotOf(b, frame->can_id & ~CAN_RTR_FLAG);
+    if (i) {
+        // refresh channel activity
+        atomic_store_explicit(&b->ports.p[i].lastrx, CanNow(),
+                              memory_order_relaxed);
+        CanPortFrame(b, i, frame, rxstamp);
+    } else if (!(frame->can_id & CAN_RTR_FLAG) && CanIdPort(b, frame->can_id)) {
+        printf("An unknown node is using CAN ID 0x%x. Ask for UUID\n", frame->can_id);
+        // Looks like lost hanshake, try to re-init
+        CanPortReset(b, frame->can_id - 1);
+    }
+}
+
+// Software stamp of SO_TIMESTAMPING, 0 if the kernel gave none
+static uint64_t CanRxStamp(struct msghdr *msg)
+{
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR(msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPING) {
+            struct scm_timestamping ts;
+            memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+            return (uint64_t)ts.ts[0].tv_sec * 1000000000ULL +
+                ts.ts[0].tv_nsec;
+        }
+    }
+    return 0;
+}
+
+static void CanRxSock(tCanBus *b, struct mmsghdr *msgs, tCanFrame *frames)
+{
+    for (int i = 0; i < CAN_RX_BATCH; i++)
+        msgs[i].msg_hdr.msg_controllen = CAN_RX_CTRL;
+    // Drain everything the socket has queued in one call
+    int n = recvmmsg(b->sock, msgs, CAN_RX_BATCH, MSG_DONTWAIT, NULL);
+    for(int i=0; i<n; i++) {
+        // classic and FD frames share the same layout
+        if (msgs[i].msg_len == CAN_MTU || msgs[i].msg_len == CANFD_MTU) {
+            uint64_t stamp = CanRxStamp(&msgs[i].msg_hdr);
+            if (b->ctx->cap)
+                CapFrame(b->ctx->cap, b->index, CAP_RX, &frames[i],
+                         msgs[i].msg_len, stamp);
+            CanRxFrame(b, &frames[i], stamp);
+        }
+    }
+}
+
+// Largest valid CAN FD payload length not above len
+static int CanFdLen(int len)
+{
+    static const uint8_t fdlen[] = { 64, 48, 32, 24, 20, 16, 12 };
+
+    for (int i = 0; i < (int)sizeof(fdlen); i++) {
+        if (len >= fdlen[i])
+            return fdlen[i];
+    }
+    // 9..11 would round up to a 12 byte DLC and pad the stream
+    return len > CAN_DATA_SIZE ? CAN_DATA_SIZE : len;
+}
+
+static void CanTxEntry(tTxEntry *tx, canid_t id, uint8_t len,
+                       const uint8_t *data, int fd, uint64_t born,
+                       tTxAcct *acct);
+static int CanSockQueue(tCanBus *b, canid_t id, uint8_t len, uint8_t* data,
+                        int fd, uint64_t born, tTxAcct *acct);
+
+// Cut data into as few data frames as the port allows. born is when the
+// data was read, the TX thread accounts the frames to acct. Returns the
+// number of frames queued or a negative error.
+static int CanSendData(tCanBus *b, canid_t canid, int fdmode,
+                       const uint8_t *data, int len,
+                       uint64_t born, tTxAcct *acct)
+{
+    int frames = 0;
+
+    while (len > 0) {
+        int n;
+        if (fdmode) {
+            n = CanFdLen(len);
+        } else {
+            n = len > CAN_DATA_SIZE ? CAN_DATA_SIZE : len;
+        }
+        int res = CanSockQueue(b, canid, n, (uint8_t *)data, fdmode, born,
+                               acct);
+        if (res)
+            return -res;
+        frames++;
+        data += n;
+        len -= n;
+    }
+    return frames;
+}
+
+static void CanPortSend(tCanBus *b, tPortId *p, uint8_t *data, int len,
+                        uint64_t born)
+{
+    int frames = CanSendData(b, p->canid, p->fdmode, data, len, born,
+                             &p->tx);
+    CntAdd(&p->rxc.bytes_out, len);
+    if (frames > 0)
+        CntAdd(&p->rxc.frames_queued, frames);
+}
+
+static void CanFlushStage(tCanBus *b, tPortId *p)
+{
+    if (p->stagelen) {
+        CanPortSend(b, p, p->stage, p->stagelen, p->stageat);
+        p->stagelen = 0;
+    }
+}
+
+// Leave the bytes in the pty or socket while the TX thread catches up
+static int CanPortThrottle(tCanBus *b, tPortId *p)
+{
+    if (TXQ_SIZE - TxqDepth(b->txq) >= CAN_TX_HEADROOM)
+        return 0;
+    p->throttled = 1;
+    atomic_store(&b->txthrottled, 1);
+    CanPortEvents(b, p);
+    return 1;
+}
+
+// One past the last 0x7E end-of-message marker in buf, 0 if there is
+// none. 16 bytes per step with SSE2 or NEON, bytewise elsewhere.
+static int CanLastEom(const uint8_t *buf, int len)
+{
+    int i = len;
+
+#if defined(__SSE2__)
+    const __m128i eom = _mm_set1_epi8(0x7E);
+    for (; i >= 16; i -= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i - 16));
+        int m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, eom));
+        if (m)
+            return i - 16 + 32 - __builtin_clz(m);
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t eom = vdupq_n_u8(0x7E);
+    for (; i >= 16; i -= 16) {
+        uint8x16_t c = vceqq_u8(vld1q_u8(buf + i - 16), eom);
+        // a nibble per byte, NEON has no movemask
+        uint64_t m = vget_lane_u64(vreinterpret_u64_u8(
+            vshrn_n_u16(vreinterpretq_u16_u8(c), 4)), 0);
+        if (m)
+            return i - 16 + (63 - __builtin_clzll(m)) / 4 + 1;
+    }
+#endif
+    for (; i > 0; i--) {
+        if (buf[i - 1] == 0x7E)
+            return i;
+    }
+    return 0;
+}
+
+static void CanRxPort(tCanBus *b, uint32_t rxid, uint32_t events)
+{
+    uint8_t rxbuf[CANFD_DATA_SIZE + PTY_READ_MAX];
+    int i = CanSlotOf(b, rxid);
+
+    if (!i)
+        return;
+    tPortId *p = &b->ports.p[i];
+
+    if ((events & EPOLLOUT) && b->urptys) {
+        p->urblocked = 0;
+        CanUrQueue(b, p);
+        CanPortEvents(b, p);
+    } else if (events & EPOLLOUT) {
+        if (RbDrain(p->rx, p->fd) <= 0)
+            CanPortEvents(b, p);
+        CanCreditTopUp(b, p);
+    }
+    if (!(events & EPOLLIN))
+        return;
+
+    if (CanPortThrottle(b, p))
+        return;
+
+    // Take all the pty has, as much as the TX queue headroom holds in
+    // frames. Without credit the bytes stay in the pty until the node
+    // grants more.
+    int max = CAN_TX_HEADROOM * p->maxlen;
+    if (max > PTY_READ_MAX)
+        max = PTY_READ_MAX;
+    int n = CanCreditTake(p, 1, max);
+    if (n == 0) {
+        CanPortEvents(b, p);
+        return;
+    }
+
+    // Staged bytes go first, the read lands right behind them
+    int staged = p->stagelen;
+    memcpy(rxbuf, p->stage, staged);
+    ssize_t rl = read (p->fd, rxbuf + staged, n);
+    CanCreditGive(p, n - (rl > 0 ? rl : 0));
+    if (rl <= 0)
+        return;
+    uint64_t now = CanNow();
+    int total = staged + rl;
+    int eom = CanLastEom(rxbuf + staged, rl);
+    if (eom)
+        p->active = 1; // Now we can send responses
+
+    if (b->cfg->coalesce_us == 0) {
+        CanPortSend(b, p, rxbuf, total, now);
+        return;
+    }
+
+    // Send the full frames and everything up to the last message end,
+    // hold the rest to fill a frame until it has waited long enough
+    int send = total - total % p->maxlen;
+    if (eom && staged + eom > send)
+        send = staged + eom;
+    if (send > 0) {
+        CanPortSend(b, p, rxbuf, send, staged ? p->stageat : now);
+        p->stagelen = 0;
+    }
+    int rest = total - send;
+    if (rest == 0)
+        return;
+    if (p->stagelen == 0) {
+        p->stageat = now;
+        p->deadline = now + b->cfg->coalesce_us * 1000ULL;
+    }
+    memcpy(p->stage, rxbuf + send, rest);
+    p->stagelen = rest;
+    CanPortTimer(b, p);
+}
+
+static void CanClientClose(tCanBus *b, tPortId *p)
+{
+    epoll_ctl(CanPortEpoll(b, p), EPOLL_CTL_DEL, p->csock, NULL);
+    close(p->csock);
+    p->csock = -1;
+    p->crx->tail = p->crx->head;
+    p->cneed = 0;
+    CanCreditTopUp(b, p);
+    if (b->ctx->cap)
+        CapEvent(b->ctx->cap, b->index, "port %d socket closed", p->port);
+}
+
+// New host on the unix socket of a port
+static void CanRxListen(tCanBus *b, uint32_t rxid)
+{
+    int i = CanSlotOf(b, rxid);
+    if (!i)
+        return;
+    tPortId *p = &b->ports.p[i];
+
+    int fd = accept4(p->lsock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+    if (p->csock >= 0) {
+        // Port is taken, like a pty it has a single user
+        close(fd);
+        return;
+    }
+    p->csock = fd;
+    struct epoll_event ev;
+    ev.events = 0;
+    ev.data.u64 = EV_DATA(EV_CLIENT, p->canid + 1);
+    epoll_ctl(CanPortEpoll(b, p), EPOLL_CTL_ADD, fd, &ev);
+    CanPortEvents(b, p);
+    if (b->ctx->cap)
+        CapEvent(b->ctx->cap, b->index, "port %d socket opened", p->port);
+    // Send reset to MCU, same as opening the pty
+    CanPortReset(b, p->canid);
+}
+
+// Every datagram from the client is one message, cut into frames
+// right away without coalescing
+static void CanRxClient(tCanBus *b, uint32_t rxid, uint32_t events)
+{
+    uint8_t msg[UNIX_MSG_MAX];
+    int i = CanSlotOf(b, rxid);
+
+    if (!i)
+        return;
+    tPortId *p = &b->ports.p[i];
+    if (p->csock < 0)
+        return;
+
+    if (events & (EPOLLHUP | EPOLLERR)) {
+        CanClientClose(b, p);
+        return;
+    }
+    if (events & EPOLLOUT) {
+        if (RbDrainRec(p->crx, p->csock) <= 0)
+            CanPortEvents(b, p);
+        CanCreditTopUp(b, p);
+    }
+    if (!(events & EPOLLIN))
+        return;
+    if (CanPortThrottle(b, p))
+        return;
+
+    // A datagram goes out whole or waits in the socket for more credit
+    int n = 0;
+    if (atomic_load_explicit(&p->credit, memory_order_relaxed)) {
+        ssize_t need = recv(p->csock, NULL, 0,
+                            MSG_DONTWAIT | MSG_PEEK | MSG_TRUNC);
+        if (need > (ssize_t)sizeof(msg))
+            need = sizeof(msg); // dropped below
+        if (need > 0) {
+            n = CanCreditTake(p, need, need);
+            if (n == 0) {
+                p->cneed = need;
+                CanPortEvents(b, p);
+                return;
+            }
+            p->cneed = 0;
+        }
+    }
+
+    ssize_t rl = recv(p->csock, msg, sizeof(msg), MSG_DONTWAIT | MSG_TRUNC);
+    CanCreditGive(p, n - (rl > 0 && rl <= (ssize_t)sizeof(msg) ? rl : 0));
+    if (rl == 0) {
+        CanClientClose(b, p);
+        return;
+    }
+    if (rl < 0)
+        return;
+    if (rl > (ssize_t)sizeof(msg)) {
+        fprintf(stderr, "Port %d: dropped %zd byte datagram\n", p->port, rl);
+        return;
+    }
+    // Keep the pty bytes in order before this message
+    CanFlushStage(b, p);
+    CanPortSend(b, p, msg, rl, CanNow());
+}
+
+// Bulk message from the node, on to the client or dropped
+static void CanRxIsotp(tCanBus *b, uint32_t rxid, uint32_t events)
+{
+    uint8_t msg[CAN_BULK_MAX];
+    int i = CanSlotOf(b, rxid);
+
+    if (!i)
+        return;
+    tPortId *p = &b->ports.p[i];
+    if (p->tpsock < 0)
+        return;
+
+    if (events & EPOLLERR) {
+        // flow control timeout or overflow, the message is lost
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(p->tpsock, SOL_SOCKET, SO_ERROR, &err, &len);
+        fprintf(stderr, "Port %d bulk: %s\n", p->port, strerror(err));
+    }
+    if ((events & EPOLLOUT) && p->tpbusy) {
+        p->tpbusy = 0;
+        CanBulkEvents(b, p);
+    }
+    if (!(events & EPOLLIN))
+        return;
+    ssize_t rl = recv(p->tpsock, msg, sizeof(msg), MSG_DONTWAIT);
+    if (rl <= 0)
+        return;
+    atomic_store_explicit(&p->lastrx, CanNow(), memory_order_relaxed);
+    CntAdd(&p->rxc.bytes_in, rl);
+    if (p->bcsock < 0 ||
+        send(p->bcsock, msg, rl, MSG_DONTWAIT | MSG_NOSIGNAL) != rl)
+        CntAdd(&p->rxc.drops, rl);
+}
+
+static void CanRxBulkListen(tCanBus *b, uint32_t rxid)
+{
+    int i = CanSlotOf(b, rxid);
+    if (!i)
+        return;
+    tPortId *p = &b->ports.p[i];
+
+    int fd = accept4(p->blsock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+    if (p->bcsock >= 0 || p->tpsock < 0) {
+        close(fd);
+        return;
+    }
+    p->bcsock = fd;
+    struct epoll_event ev;
+    ev.events = 0;
+    ev.data.u64 = EV_DATA(EV_BULKCLIENT, p->canid + 1);
+    epoll_ctl(CanPortEpoll(b, p), EPOLL_CTL_ADD, fd, &ev);
+    CanBulkEvents(b, p);
+}
+
+// One datagram is one bulk message. It is only peeked at until the
+// kernel takes it, a busy ISO-TP socket leaves it queued.
+static void CanRxBulkClient(tCanBus *b, uint32_t rxid, uint32_t events)
+{
+    uint8_t msg[CAN_BULK_MAX];
+    int i = CanSlotOf(b, rxid);
+
+    if (!i)
+        return;
+    tPortId *p = &b->ports.p[i];
+    if (p->bcsock < 0)
+        return;
+
+    if (!(events & EPOLLIN) && (events & (EPOLLHUP | EPOLLERR)))
+        goto hangup;
+    ssize_t rl = recv(p->bcsock, msg, sizeof(msg),
+                      MSG_DONTWAIT | MSG_PEEK | MSG_TRUNC);
+    if (rl == 0)
+        goto hangup;
+    if (rl < 0)
+        return;
+    if (rl > (ssize_t)sizeof(msg)) {
+        fprintf(stderr, "Port %d: dropped %zd byte bulk message\n",
+                p->port, rl);
+    } else if (send(p->tpsock, msg, rl, MSG_DONTWAIT) < 0) {
+        if (errno == EAGAIN) {
+            // previous message still going out
+            p->tpbusy = 1;
+            CanBulkEvents(b, p);
+            return;
+        }
+        perror("CAN_ISOTP send");
+    } else {
+        CntAdd(&p->rxc.bytes_out, rl);
+        p->tpbusy = 1;
+        CanBulkEvents(b, p);
+    }
+    recv(p->bcsock, msg, 0, MSG_DONTWAIT); // done with it
+    return;
+
+hangup:
+    epoll_ctl(CanPortEpoll(b, p), EPOLL_CTL_DEL, p->bcsock, NULL);
+    close(p->bcsock);
+    p->bcsock = -1;
+}
+
+// First slot served by loop k, the RX thread 0 and workers from 1, the
+// next one is CanLoopStep slots on
+static int CanLoopFirst(tCanBus *b, int k)
+{
+    if (k == 0)
+        return 1;
+    return k - 1 ? k - 1 : b->nshards; // p[0] is unused
+}
+
+static int CanLoopStep(tCanBus *b, int k)
+{
+    return k ? b->nshards : 1;
+}
+
+// Coalescing deadline of loop k passed, send whatever is staged on
+// its expired ports
+static void CanRxTimer(tCanBus *b, int k)
+{
+    tCanShard *s = k ? &b->shards[k - 1] : NULL;
+    uint64_t *nextdl = s ? &s->nextdeadline : &b->nextdeadline;
+    int fd = s ? s->Timerfd : b->Timerfd;
+    uint64_t expirations;
+    uint64_t now = CanNow();
+    uint64_t next = 0;
+
+    read(fd, &expirations, sizeof(expirations));
+    int ptr = atomic_load(&b->ports.portptr);
+    for(int i=CanLoopFirst(b, k); i<ptr; i+=CanLoopStep(b, k)) {
+        tPortId *p = &b->ports.p[i];
+        if (!p->stagelen)
+            continue;
+        if (p->deadline <= now)
+            CanFlushStage(b, p);
+        else if (next == 0 || p->deadline < next)
+            next = p->deadline;
+    }
+    *nextdl = 0;
+    if (next)
+        CanArmTimer(fd, nextdl, next);
+}
+
+// TX queue drained, resume reading the throttled ptys of loop k
+static void CanUnthrottle(tCanBus *b, int k)
+{
+    int ptr = atomic_load(&b->ports.portptr);
+
+    for(int i=CanLoopFirst(b, k); i<ptr; i+=CanLoopStep(b, k)) {
+        tPortId *p = &b->ports.p[i];
+        if (CanAttached(atomic_load(&p->state)) && p->throttled) {
+            p->throttled = 0;
+            CanPortEvents(b, p);
+        }
+    }
+}
+
+// The ptys of all loops are read again
+static void CanPortsResume(tCanBus *b) {
+    if (!b->nshards) {
+        CanUnthrottle(b, 0);
+        return;
+    }
+    for (int k = 0; k < b->nshards; k++)
+        CanShardCmd(b, k, PC_RESUME, 0);
+}
+
+static void CanRxInotify(tCanBus *b)
+{
+    char ev_buf[EVENT_BUF_LEN];
+    int i;
+
+    ssize_t ev = read( b->Inotify, ev_buf, EVENT_BUF_LEN );
+    if ( ev > 0 ) {
+        for (char *p = ev_buf; p < ev_buf + ev; ) {
+            struct inotify_event *event = (struct inotify_event *) p;
+            int ptr = atomic_load(&b->ports.portptr);
+            for(i=1; i<ptr; i++) {
+                int state = atomic_load(&b->ports.p[i].state);
+                if(state != PORT_FREE && state != PORT_CLOSING &&
+                   b->ports.p[i].watch == event->wd) {
+                    if ( event->mask & IN_OPEN ) {
+                        if (CanAttached(state))
+                            CanPortCmd(b, i, PC_ACTIVE, 1);
+                        else
+                            b->ports.p[i].active = 1;
+                        if (b->ctx->cap)
+                            CapEvent(b->ctx->cap, b->index, "port %d pty opened",
+                                     b->ports.p[i].port);
+                        // Send reset to MCU, one still being set up
+                        // gets its SET anyway
+                        if (state != PORT_PROVISION)
+                            CanPortReset(b, b->ports.p[i].canid);
+                    } else if ( event->mask & IN_CLOSE ) {
+                        if (CanAttached(state))
+                            CanPortCmd(b, i, PC_ACTIVE, 0);
+                        else
+                            b->ports.p[i].active = 0;
+                        if (b->ctx->cap)
+                            CapEvent(b->ctx->cap, b->index, "port %d pty closed",
+                                     b->ports.p[i].port);
+                    }
+                    break;
+                }
+            }
+            p += EVENT_SIZE + event->len;
+        }
+    }
+}
+
+// Serve every ready source in the same pass, bus traffic must not
+// starve the ptys and vice versa. Workers dispatch their set here too.
+static void CanRxEvents(tCanBus *b, struct epoll_event *events, int n,
+                        struct mmsghdr *msgs, tCanFrame *frames)
+{
+    uint64_t wakes;
+
+    for (int i = 0; i < n; i++) {
+        uint64_t data = events[i].data.u64;
+        uint64_t t0 = CanProfIn();
+
+        switch (EV_TYPE(data)) {
+        case EV_CAN:
+            CanRxSock(b, msgs, frames);
+            break;
+        case EV_PORT:
+            CanRxPort(b, EV_ID(data), events[i].events);
+            break;
+        case EV_LISTEN:
+            CanRxListen(b, EV_ID(data));
+            break;
+        case EV_CLIENT:
+            CanRxClient(b, EV_ID(data), events[i].events);
+            break;
+        case EV_ISOTP:
+            CanRxIsotp(b, EV_ID(data), events[i].events);
+            break;
+        case EV_BULKLISTEN:
+            CanRxBulkListen(b, EV_ID(data));
+            break;
+        case EV_BULKCLIENT:
+            CanRxBulkClient(b, EV_ID(data), events[i].events);
+            break;
+        case EV_INOTIFY:
+            CanRxInotify(b);
+            break;
+        case EV_TIMER:
+            CanRxTimer(b, EV_ID(data));
+            break;
+        case EV_WAKE:
+            read(b->Wakefd, &wakes, sizeof(wakes));
+            CanCtlDone(b);
+            CanRetirePorts(b);
+            if (atomic_exchange(&b->txresume, 0))
+                CanPortsResume(b);
+            break;
+        case EV_SHARD:
+            // the queue itself is run at the end of the pass
+            read(b->shards[EV_ID(data)].Wakefd, &wakes, sizeof(wakes));
+            break;
+        }
+        CanProfOut(CanEvStage[EV_TYPE(data)], t0);
+    }
+}
+
+static void CanRxEpoll(tCanBus *b, struct epoll_event *events,
+                       struct mmsghdr *msgs, tCanFrame *frames)
+{
+    // Spinning keeps the thread on its core while traffic is recent,
+    // the next frame then costs no wakeup
+    const int spin = b->cfg->wait == CAN_WAIT_SPIN;
+    uint64_t spinuntil = 0;
+
+    while (atomic_load(&b->threadexit)==0) {
+        int timeout = spin && CanNow() < spinuntil ? 0 : 1000;
+        uint64_t t0 = CanProfIn();
+        int ret = epoll_wait(b->Epoll, events, MAX_EPOLL_EVENTS, timeout);
+        CanProfOut(PROF_POLL, t0);
+        if (ret > 0 || timeout)
+            CntAdd(&b->rxstats.wakeups, 1);
+        if (spin && ret > 0)
+            spinuntil = CanNow() + b->cfg->spin_us * 1000ULL;
+
+        CanRxEvents(b, events, ret, msgs, frames);
+        CanShardKick(b);
+        // Done with any hook loaded in this pass
+        atomic_fetch_add_explicit(&b->rxepoch, 1, memory_order_release);
+    }
+}
+
+static void CanUrRecvArm(tCanBus *b)
+{
+    struct io_uring_sqe *sqe = UrSqe(&b->ur);
+
+    if (!sqe)
+        return; // next pass
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = b->sock;
+    sqe->addr = (uintptr_t)&b->urmsg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = UR_DATA(UR_RECV, 0, 0);
+    b->urrecv = 1;
+}
+
+// Receive through the epoll set again, as without io_uring
+static void CanUrRecvOff(tCanBus *b, int err)
+{
+    struct epoll_event ev;
+
+    fprintf(stderr, "%s: io_uring receive failed (%s), reading the CAN "
+            "socket on epoll\n", b->ifname, strerror(err));
+    b->urrecv = -1;
+    ev.events = EPOLLIN;
+    ev.data.u64 = EV_DATA(EV_CAN, 0);
+    epoll_ctl(b->Epoll, EPOLL_CTL_ADD, b->sock, &ev);
+}
+
+// One frame of the multishot receive. The buffer holds the recvmsg
+// header, the control messages as far as urmsg asked and the frame.
+static void CanUrRecv(tCanBus *b, struct io_uring_cqe *cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        b->urrecv = 0; // rearmed before the next submit
+    if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+        // Out of buffers is what ends a multishot receive normally
+        if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -EINTR)
+            CanUrRecvOff(b, -cqe->res);
+        return;
+    }
+
+    uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    uint8_t *buf = b->urbufs + bid * UR_BUFSIZE;
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+    size_t hdr = sizeof(*out) + b->urmsg.msg_controllen;
+    if (cqe->res >= (int)hdr && !(out->flags & MSG_TRUNC) &&
+        (out->payloadlen == CAN_MTU || out->payloadlen == CANFD_MTU)) {
+        struct msghdr msg;
+        tCanFrame frame;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = buf + sizeof(*out);
+        msg.msg_controllen = out->controllen;
+        memcpy(&frame, buf + hdr, out->payloadlen);
+        uint64_t stamp = CanRxStamp(&msg);
+        if (b->ctx->cap)
+            CapFrame(b->ctx->cap, b->index, CAP_RX, &frame,
+                     out->payloadlen, stamp);
+        CanRxFrame(b, &frame, stamp);
+    }
+    UrBufPut(&b->ur, buf, UR_BUFSIZE, bid);
+}
+
+static void CanUrWrite(tCanBus *b, tPortId *p, const uint8_t *buf,
+                       uint32_t len, int link)
+{
+    struct io_uring_sqe *sqe = UrSqe(&b->ur);
+
+    sqe->opcode = b->urfixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = p->fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = (uint64_t)-1; // ptys have no file position
+    sqe->buf_index = 0;
+    sqe->flags = link ? IOSQE_IO_LINK : 0;
+    sqe->user_data = UR_DATA(UR_WRITE, p - b->ports.p, p->urgen);
+}
+
+// Queue writes of all rings with data waiting. A wrapped ring takes
+// two writes, linked so that they land in order: a short first one
+// cancels the second.
+static void CanUrFlush(tCanBus *b)
+{
+    int keep = 0;
+
+    for (int k = 0; k < b->nurdirty; k++) {
+        tPortId *p = &b->ports.p[b->urdirty[k]];
+        uint32_t used = p->rx ? RbUsed(p->rx) : 0;
+
+        if (p->fd < 0 || used == 0 || p->urwrites || p->urblocked) {
+            p->urqueued = 0;
+            continue;
+        }
+        uint32_t pos = p->rx->tail & (RING_SIZE - 1);
+        uint32_t first = RING_SIZE - pos;
+        int cnt = first < used ? 2 : 1;
+        // A pair never straddles two submits
+        if (UrSpace(&b->ur) < (unsigned)cnt)
+            UrSubmit(&b->ur, 0, 0);
+        if (UrSpace(&b->ur) < (unsigned)cnt) {
+            b->urdirty[keep++] = b->urdirty[k]; // next pass
+            continue;
+        }
+        p->urqueued = 0;
+        if (cnt == 1) {
+            CanUrWrite(b, p, p->rx->buf + pos, used, 0);
+        } else {
+            CanUrWrite(b, p, p->rx->buf + pos, first, 1);
+            CanUrWrite(b, p, p->rx->buf, used - first, 0);
+        }
+        p->urwrites = cnt;
+    }
+    b->nurdirty = keep;
+}
+
+static void CanUrWritten(tCanBus *b, uint64_t data, int res)
+{
+    tPortId *p = &b->ports.p[UR_SLOT(data)];
+
+    if (UR_GEN(data) != (p->urgen & 0xFFFFFF) || p->urwrites == 0)
+        return; // the port was closed meanwhile
+    p->urwrites--;
+    if (res > 0) {
+        p->rx->tail += res;
+    } else if (res == 0 || res == -EAGAIN) {
+        p->urblocked = 1;
+    } else if (res != -ECANCELED && res != -EINTR) {
+        // Hard error, the content is dropped like RbDrain does
+        p->rx->drops += RbUsed(p->rx);
+        p->rx->tail = p->rx->head;
+    }
+    if (p->urwrites)
+        return;
+    if (p->urblocked)
+        CanPortEvents(b, p);
+    else if (RbUsed(p->rx))
+        CanUrQueue(b, p);
+    CanCreditTopUp(b, p);
+}
+
+// Set up the io_uring engine of the bus, 0 if it has to stay on epoll
+static int CanUrInit(tCanBus *b)
+{
+    int r = UrInit(&b->ur, UR_ENTRIES, UR_CQ_ENTRIES);
+
+    if (r < 0) {
+        fprintf(stderr, "%s: no io_uring (%s), using epoll\n", b->ifname,
+                strerror(-r));
+        return 0;
+    }
+    // Pty writes straight from the rings without mapping them every time,
+    // needs RLIMIT_MEMLOCK for the pool or CAP_IPC_LOCK. The workers
+    // write their ptys themselves.
+    b->urptys = !b->nshards;
+    b->urfixed = b->urptys &&
+        UrRegisterBuf(&b->ur, b->rings.rings,
+                      2 * b->cfg->maxports * sizeof(tRing)) == 0;
+
+    // Multishot receive needs provided buffers (5.19) and multishot
+    // recvmsg (6.0), without them the CAN socket stays on the epoll set
+    memset(&b->urmsg, 0, sizeof(b->urmsg));
+    b->urmsg.msg_controllen = CAN_RX_CTRL;
+    b->urrecv = -1;
+    b->urbufs = aligned_alloc(64, UR_BUFS * UR_BUFSIZE);
+    if (b->urbufs && UrBufRing(&b->ur, b->urbufs, UR_BUFS, UR_BUFSIZE) == 0) {
+        CanUrRecvArm(b);
+        UrSubmit(&b->ur, 0, 0);
+        // An unknown flag fails at once
+        struct io_uring_cqe *cqe = UrPeek(&b->ur);
+        if (cqe && UR_OP(cqe->user_data) == UR_RECV && cqe->res == -EINVAL) {
+            UrSeen(&b->ur);
+            b->urrecv = -1;
+        }
+    }
+    if (b->urrecv > 0)
+        epoll_ctl(b->Epoll, EPOLL_CTL_DEL, b->sock, NULL);
+    b->uring = 1;
+    printf("%s: io_uring engine, %s receive, %s pty writes\n", b->ifname,
+           b->urrecv > 0 ? "multishot" : "epoll",
+           !b->urptys ? "worker" : b->urfixed ? "fixed buffer" : "plain");
+    return 1;
+}
+
+// Take the receive off the buffers before they are freed
+static void CanUrExit(tCanBus *b)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+
+    if (b->urrecv > 0 && (sqe = UrSqe(&b->ur))) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = UR_DATA(UR_RECV, 0, 0);
+        while (b->urrecv > 0 &&
+               UrSubmit(&b->ur, 1, 100 * 1000000ULL) >= 0 && UrPeek(&b->ur)) {
+            while ((cqe = UrPeek(&b->ur))) {
+                if (UR_OP(cqe->user_data) == UR_RECV &&
+                    !(cqe->flags & IORING_CQE_F_MORE))
+                    b->urrecv = 0;
+                UrSeen(&b->ur);
+            }
+        }
+    }
+    UrExit(&b->ur);
+    free(b->urbufs);
+    b->urbufs = NULL;
+}
+
+// Same loop on io_uring: frames and pty write completions come from the
+// ring, the epoll set with everything else is one more source polled
+// by it. Ring writes queued during a pass go out with the submit that
+// waits for the next one, steady forwarding costs one syscall per pass.
+static void CanRxUring(tCanBus *b, struct epoll_event *events,
+                       struct mmsghdr *msgs, tCanFrame *frames)
+{
+    const int spin = b->cfg->wait == CAN_WAIT_SPIN;
+    uint64_t spinuntil = 0;
+    struct io_uring_cqe *cqe;
+
+    while (atomic_load(&b->threadexit)==0) {
+        uint64_t t0 = CanProfIn();
+        CanUrFlush(b);
+        CanProfOut(PROF_PTYWRITE, t0);
+        if (b->urrecv == 0)
+            CanUrRecvArm(b);
+        if (!b->urpoll) {
+            // One shot, armed again it completes at once while the
+            // epoll set still has events
+            struct io_uring_sqe *sqe = UrSqe(&b->ur);
+            if (sqe) {
+                sqe->opcode = IORING_OP_POLL_ADD;
+                sqe->fd = b->Epoll;
+                sqe->poll32_events = POLLIN;
+                sqe->user_data = UR_DATA(UR_EPOLL, 0, 0);
+                b->urpoll = 1;
+            }
+        }
+        int wait = !(spin && CanNow() < spinuntil) && !UrPeek(&b->ur);
+        t0 = CanProfIn();
+        UrSubmit(&b->ur, wait, 1000 * 1000000ULL);
+        CanProfOut(PROF_POLL, t0);
+
+        int work = 0, ready = 0;
+        while ((cqe = UrPeek(&b->ur))) {
+            t0 = CanProfIn();
+            switch (UR_OP(cqe->user_data)) {
+            case UR_EPOLL:
+                b->urpoll = 0;
+                ready = 1;
+                break;
+            case UR_RECV:
+                CanUrRecv(b, cqe);
+                CanProfOut(PROF_FRAMES, t0);
+                break;
+            case UR_WRITE:
+                CanUrWritten(b, cqe->user_data, cqe->res);
+                CanProfOut(PROF_PTYWRITE, t0);
+                break;
+            }
+            UrSeen(&b->ur);
+            work++;
+        }
+        if (ready) {
+            int n = epoll_wait(b->Epoll, events, MAX_EPOLL_EVENTS, 0);
+            CanRxEvents(b, events, n, msgs, frames);
+        }
+        if (work || wait)
+            CntAdd(&b->rxstats.wakeups, 1);
+        if (spin && work)
+            spinuntil = CanNow() + b->cfg->spin_us * 1000ULL;
+        CanShardKick(b);
+        // Done with any hook loaded in this pass
+        atomic_fetch_add_explicit(&b->rxepoch, 1, memory_order_release);
+    }
+}
+
+// Run what the RX thread queued, in its order
+static int CanShardDrain(tCanShard *s)
+{
+    tCanBus *b = s->b;
+    unsigned tail = atomic_load_explicit(&s->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&s->head, memory_order_acquire);
+    int n = head - tail;
+
+    for (; tail != head; tail++) {
+        const tShardMsg *m = &s->q[tail & (SHARD_QUEUE - 1)];
+        if (m->op == PC_RESUME)
+            CanUnthrottle(b, s->index + 1);
+        else
+            CanPortRun(b, m->slot, m->op, m->arg, &m->frame, m->stamp);
+        // room for the RX thread right away, a burst may fill q
+        atomic_store_explicit(&s->tail, tail + 1, memory_order_release);
+    }
+    CntAdd(&s->msgs, n);
+    return n;
+}
+
+// Loop of a worker. The queue goes last in a pass: a port it closes
+// may still have events in this batch, the next epoll_wait has none.
+static void *CanShardThread(void *ptr)
+{
+    tCanShard *s = ptr;
+    tCanBus *b = s->b;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    const int spin = b->cfg->wait == CAN_WAIT_SPIN;
+    uint64_t spinuntil = 0;
+
+    if (b->cfg->profile)
+        CanProf = &s->prof;
+
+    while (atomic_load(&s->exit)==0) {
+        int timeout = spin && CanNow() < spinuntil ? 0 : 1000;
+        if (timeout) {
+            // pairs with the fence in CanShardKick
+            atomic_store(&s->sleeping, 1);
+            if (atomic_load(&s->head) != atomic_load(&s->tail))
+                timeout = 0;
+        }
+        uint64_t t0 = CanProfIn();
+        int ret = epoll_wait(s->Epoll, events, MAX_EPOLL_EVENTS, timeout);
+        CanProfOut(PROF_POLL, t0);
+        atomic_store(&s->sleeping, 0);
+        if (ret > 0 || timeout)
+            CntAdd(&s->wakeups, 1);
+
+        CanRxEvents(b, events, ret, NULL, NULL);
+        t0 = CanProfIn();
+        int work = CanShardDrain(s);
+        if (work)
+            CanProfOut(PROF_QUEUE, t0);
+        if (spin && (ret > 0 || work))
+            spinuntil = CanNow() + b->cfg->spin_us * 1000ULL;
+        // Done with any hook loaded in this pass
+        atomic_fetch_add_explicit(&s->epoch, 1, memory_order_release);
+    }
+    // The RX thread queues nothing any more, close what it asked for
+    CanShardDrain(s);
+    return NULL;
+}
+
+// Workers go before the ports, with everything queued for them done
+static void CanShardsStop(tCanBus *b)
+{
+    for (int k = 0; k < b->nshards; k++) {
+        tCanShard *s = &b->shards[k];
+        if (!s->run)
+            continue;
+        atomic_store(&s->exit, 1);
+        CanShardWake(s);
+        pthread_join(s->th, NULL);
+        s->run = 0;
+    }
+}
+
+// close and delete fd's, once no loop serves the ports any more
+static void CanPortsClose(tCanBus *b)
+{
+    int last = atomic_load(&b->ports.portptr);
+
+    for (int i = 1; i < last; i++) {
+        int state = atomic_load(&b->ports.p[i].state);
+        if (state == PORT_FREE || state == PORT_CLOSING)
+            continue;
+        printf("close port %d\n", i);
+        CanVportClose(b, &(b->ports.p[i]));
+    }
+}
+
+static void *CanRxThread( void *ptr )
+{
+    tCanBus *b = ptr;
+    int i;
+    tCanFrame frames[CAN_RX_BATCH];
+    struct mmsghdr msgs[CAN_RX_BATCH];
+    struct iovec iovs[CAN_RX_BATCH];
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    // cmsg buffers must be aligned for struct cmsghdr
+    union {
+        char buf[CAN_RX_CTRL];
+        struct cmsghdr align;
+    } ctrl[CAN_RX_BATCH];
+
+    if (b->cfg->profile)
+        CanProf = &b->rxprof;
+    memset(msgs, 0, sizeof(msgs));
+    for(i=0; i<CAN_RX_BATCH; i++) {
+        iovs[i].iov_base = &frames[i];
+        iovs[i].iov_len = sizeof(tCanFrame);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = ctrl[i].buf;
+    }
+
+    // The ring belongs to the thread submitting to it
+    if (b->cfg->uring && CanUrInit(b))
+        CanRxUring(b, events, msgs, frames);
+    else
+        CanRxEpoll(b, events, msgs, frames);
+    CanShardsStop(b);
+    CanPortsClose(b);
+    if (b->uring)
+        CanUrExit(b);
+    return NULL;
+}
+
+// Liveness check of one bus, runs on the main thread and never blocks
+// on the RX thread: slots are read through CanPortSnapshot and dead
+// ports are only flagged, the RX thread closes them once woken up.
+// Returns when this bus needs to be looked at again.
+static uint64_t CanBusPing(tCanBus *b, uint64_t now)
+{
+    uint64_t interval = b->cfg->ping_ms * 1000000ULL;
+    // Silent nodes get pinged after this, to reduce bus load we'll
+    // send pings only if necessary
+    uint64_t pingafter = (PINGS_BEFORE_DISCONNECT - 2) * interval;
+    // and dropped after this
+    uint64_t budget = PINGS_BEFORE_DISCONNECT * interval;
+    uint64_t next;
+    canid_t canid;
+    int retired = 0;
+
+    // No node can answer, the RX thread rejoins them once it is back
+    if (atomic_load(&b->busstate) == BUS_OFF)
+        return now + interval;
+
+    if (atomic_exchange(&b->topology, 0)) {
+        // something changed, look for more nodes soon
+        b->discover_ns = b->cfg->discover_min_ms * 1000000ULL;
+        if (b->nextdiscover > now + b->discover_ns)
+            b->nextdiscover = now + b->discover_ns;
+    }
+    if (now >= b->nextdiscover) {
+        // request for new port assign
+        CanSockSend(b, PKT_ID_UUID, 0, NULL);
+        b->nextdiscover = now + b->discover_ns;
+        // Back off while the bus stays the same
+        b->discover_ns *= 2;
+        if (b->discover_ns > b->cfg->discover_max_ms * 1000000ULL)
+            b->discover_ns = b->cfg->discover_max_ms * 1000000ULL;
+    }
+    next = b->nextdiscover;
+
+    int ptr = atomic_load(&b->ports.portptr);
+    for (int i = 1; i < ptr; i++) {
+        tPortId *p = &b->ports.p[i];
+        uint64_t due;
+
+        if (CanPortSnapshot(p, &canid, NULL) != PORT_ACTIVE)
+            continue;
+        uint64_t lastrx = atomic_load_explicit(&p->lastrx,
+                                               memory_order_relaxed);
+        uint64_t silent = now > lastrx ? now - lastrx : 0;
+
+        if (silent >= budget) {
+            // The RX thread may have closed or reused the slot since
+            // the snapshot, only a port still active is retired
+            int expected = PORT_ACTIVE;
+            if (atomic_compare_exchange_strong(&p->state, &expected,
+                                               PORT_RETIRE))
+                retired++;
+            continue;
+        }
+        if (silent >= pingafter) {
+            if (now >= p->lastping + interval) {
+                CanSockSend(b, canid, 0, NULL);
+                CntAdd(&p->pingmiss, 1);
+                p->lastping = now;
+            }
+            due = p->lastping + interval;
+            if (due > lastrx + budget)
+                due = lastrx + budget;
+        } else {
+            due = lastrx + pingafter;
+        }
+        if (due < next)
+            next = due;
+    }
+
+    if (retired) {
+        atomic_store(&b->topology, 1);
+        CanWake(b);
+    }
+    return next;
+}
+
+static void *CanTxThread(void *ptr);
+
+// Small stacks when memory is locked and SCHED_FIFO on request, the
+// RX and TX threads also go to the core of the bus
+static void CanThreadAttr(tCanBus *b, pthread_attr_t *attr, int pin)
+{
+    pthread_attr_init(attr);
+    if (pin && b->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(b->cpu, &cpus);
+        pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+    }
+    if (b->cfg->mlock) {
+        // Locked stacks are populated in full, keep them small
+        pthread_attr_setstacksize(attr, CAN_THREAD_STACK);
+    }
+    if (b->cfg->rt_prio > 0) {
+        struct sched_param sp = { .sched_priority = b->cfg->rt_prio };
+        pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(attr, SCHED_FIFO);
+        pthread_attr_setschedparam(attr, &sp);
+    }
+}
+
+static int CanThreadStart(tCanBus *b, pthread_attr_t *attr, pthread_t *th,
+                          void *(*fn)(void *), void *arg)
+{
+    int retval = pthread_create(th, attr, fn, arg);
+
+    if (retval == EPERM && b->cfg->rt_prio > 0) {
+        fprintf(stderr, "%s: SCHED_FIFO not permitted, running at normal "
+                "priority\n", b->ifname);
+        pthread_attr_setinheritsched(attr, PTHREAD_INHERIT_SCHED);
+        retval = pthread_create(th, attr, fn, arg);
+    }
+    return retval;
+}
+
+// Epoll set, wakeup and coalescing timer of every worker, and the
+// workers themselves. They float over the cores, that is the point.
+static int CanShardsInit(tCanBus *b)
+{
+    struct epoll_event ev;
+    pthread_attr_t attr;
+    int retval = 0;
+
+    b->shards = aligned_alloc(64, b->cfg->shards * sizeof(tCanShard));
+    if (!b->shards) {
+        fprintf(stderr, "malloc failed!\n");
+        return ENOMEM;
+    }
+    memset(b->shards, 0, b->cfg->shards * sizeof(tCanShard));
+    CanThreadAttr(b, &attr, 0);
+    for (int k = 0; k < b->cfg->shards; k++) {
+        tCanShard *s = &b->shards[k];
+        s->b = b;
+        s->index = k;
+        s->Epoll = epoll_create1(EPOLL_CLOEXEC);
+        s->Wakefd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+        s->Timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+        b->nshards++;
+        if (s->Epoll == -1 || s->Wakefd == -1 || s->Timerfd == -1) {
+            perror("shard init");
+            retval = EINVAL;
+            break;
+        }
+        ev.events = EPOLLIN;
+        ev.data.u64 = EV_DATA(EV_SHARD, k);
+        epoll_ctl(s->Epoll, EPOLL_CTL_ADD, s->Wakefd, &ev);
+        ev.data.u64 = EV_DATA(EV_TIMER, k + 1);
+        epoll_ctl(s->Epoll, EPOLL_CTL_ADD, s->Timerfd, &ev);
+        retval = CanThreadStart(b, &attr, &s->th, CanShardThread, s);
+        if (retval)
+            break;
+        s->run = 1;
+    }
+    pthread_attr_destroy(&attr);
+    return retval;
+}
+
+// Everything CanBusInit set up, once the threads of the bus are gone
+// or never ran
+static void CanBusFree(tCanBus *b)
+{
+    close(b->sock);
+    if (b->Epoll >= 0)
+        close(b->Epoll);
+    if (b->Inotify >= 0)
+        close(b->Inotify);
+    if (b->Wakefd >= 0)
+        close(b->Wakefd);
+    if (b->Timerfd >= 0)
+        close(b->Timerfd);
+    for (int k = 0; k < b->nshards; k++) {
+        close(b->shards[k].Epoll);
+        close(b->shards[k].Wakefd);
+        close(b->shards[k].Timerfd);
+    }
+    free(b->shards);
+    b->shards = NULL;
+    b->nshards = 0;
+    if (b->txq && b->txq->wakefd >= 0)
+        close(b->txq->wakefd);
+    free(b->txq);
+    b->txq = NULL;
+    free(b->ports.p);
+    b->ports.p = NULL;
+    RbPoolFree(&b->rings);
+}
+
+static int CanBusInit(tCanBus *b)
+{
+    struct sockaddr_can addr;
+    struct ifreq ifr;
+    int retval;
+
+    b->Epoll = b->Inotify = b->Wakefd = b->Timerfd = -1;
+    /* open socket */
+    if ((b->sock = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
+        return ENOTSOCK;
+    }
+
+    addr.can_family = AF_CAN;
+
+    strcpy(ifr.ifr_name, b->ifname);
+    if (ioctl(b->sock, SIOCGIFINDEX, &ifr) < 0) {
+        retval = SIOCGIFINDEX;
+        goto fail;
+    }
+    addr.can_ifindex = ifr.ifr_ifindex;
+    b->ifindex = ifr.ifr_ifindex;
+
+    b->fd = b->cfg->fd;
+    if (b->fd) {
+        // FD needs both an FD capable interface and socket
+        int enable = 1;
+        if (ioctl(b->sock, SIOCGIFMTU, &ifr) < 0 || ifr.ifr_mtu != CANFD_MTU ||
+            setsockopt(b->sock, SOL_CAN_RAW, CAN_RAW_FD_FRAMES,
+                       &enable, sizeof(enable)) < 0) {
+            fprintf(stderr, "%s: no CAN FD support, using classic frames\n",
+                    ifr.ifr_name);
+            b->fd = 0;
+        }
+    }
+
+
+    /* enable TX blocking mode when linux can TX buffer is full
+       https://rtime.felk.cvut.cz/can/socketcan-qdisc-final.pdf */
+    int sndbuf = 0;
+    if (setsockopt(b->sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof (sndbuf)) < 0)
+        perror("setsockopt");
+
+    /* Set filters, no ports yet */
+    CanSetFilters(b);
+
+    /* Our own frames must never come back. Local loopback to other
+       sockets (candump) only on request. */
+    int zero = 0;
+    int loopback = b->cfg->loopback;
+    setsockopt(b->sock, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS, &zero, sizeof(zero));
+    setsockopt(b->sock, SOL_CAN_RAW, CAN_RAW_LOOPBACK, &loopback, sizeof(loopback));
+
+    // Error frames are counted for the statistics
+    can_err_mask_t errmask = CAN_ERR_MASK;
+    setsockopt(b->sock, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &errmask, sizeof(errmask));
+
+    if (b->cfg->wait == CAN_WAIT_BUSYPOLL) {
+        // Reads poll the driver for up to spin_us before sleeping. Only
+        // drivers using NAPI (rx-offload) take part, epoll_wait busy
+        // polls only if net.core.busy_poll is set as well.
+        int us = b->cfg->spin_us;
+        int prefer = 1;
+        if (setsockopt(b->sock, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) < 0)
+            perror("setsockopt SO_BUSY_POLL");
+#ifdef SO_PREFER_BUSY_POLL
+        else
+            setsockopt(b->sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer,
+                       sizeof(prefer));
+#endif
+    }
+
+    /* set timeout */
+    struct timeval tv;
+    tv.tv_sec = 1;  // TODO. hmm
+    tv.tv_usec = 0;
+    setsockopt(b->sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+
+    // Kernel receive stamps for the latency histograms. Hardware stamps
+    // of CAN controllers come from their own clock that can't be related
+    // to ours here, so software stamps it is.
+    int tsflags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (setsockopt(b->sock, SOL_SOCKET, SO_TIMESTAMPING,
+                   &tsflags, sizeof(tsflags)) < 0)
+        perror("setsockopt SO_TIMESTAMPING");
+
+    int rcvbuf_size = 512;	
+    if (setsockopt(b->sock, SOL_SOCKET, SO_RCVBUF,
+                   &rcvbuf_size, sizeof(rcvbuf_size)) < 0) {
+        perror("setsockopt SO_RCVBUF");
+        retval = 1;
+        goto fail;
+    }
+
+    if (bind(b->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        retval = EIO;
+        goto fail;
+    }
+
+    // Allocate ports
+    b->ports.portptr = 1; // p[0] unused
+    // Slots hold cache line aligned histograms
+    size_t slots = (b->cfg->maxports + 1) * sizeof(tPortId);
+    b->ports.p = aligned_alloc(64, slots);
+    if (!b->ports.p) {
+        fprintf(stderr, "malloc failed!\n");
+        retval = ENOMEM;
+        goto fail;
+    }
+    memset(b->ports.p, 0, slots);
+    if (RbPoolInit(&b->rings, 2 * b->cfg->maxports) < 0) {
+        fprintf(stderr, "malloc failed!\n");
+        retval = ENOMEM;
+        goto fail;
+    }
+
+    // Inotify for port open/close
+    b->Inotify = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if (b->Inotify == -1) {
+        fprintf(stderr, "unable to create inotify fd\n");
+        retval = EINVAL;
+        goto fail;
+    }
+
+    b->Wakefd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (b->Wakefd == -1) {
+        perror("eventfd");
+        retval = EINVAL;
+        goto fail;
+    }
+
+    // One event loop for the CAN socket, inotify, wakeups and all ptys
+    b->Epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (b->Epoll == -1) {
+        perror("epoll_create1");
+        retval = EINVAL;
+        goto fail;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = EV_DATA(EV_CAN, 0);
+    epoll_ctl(b->Epoll, EPOLL_CTL_ADD, b->sock, &ev);
+    ev.data.u64 = EV_DATA(EV_INOTIFY, 0);
+    epoll_ctl(b->Epoll, EPOLL_CTL_ADD, b->Inotify, &ev);
+    ev.data.u64 = EV_DATA(EV_WAKE, 0);
+    epoll_ctl(b->Epoll, EPOLL_CTL_ADD, b->Wakefd, &ev);
+
+    b->Timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (b->Timerfd == -1) {
+        perror("timerfd_create");
+        retval = EINVAL;
+        goto fail;
+    }
+    ev.data.u64 = EV_DATA(EV_TIMER, 0);
+    epoll_ctl(b->Epoll, EPOLL_CTL_ADD, b->Timerfd, &ev);
+
+    
+    b->txq = aligned_alloc(64, sizeof(tTxQueue));
+    if (!b->txq || TxqInit(b->txq) < 0) {
+        fprintf(stderr, "TX queue init failed!\n");
+        retval = ENOMEM;
+        goto fail;
+    }
+
+    // Workers run before any port is published to them
+    if (b->cfg->shards > 0 && (retval = CanShardsInit(b)) != 0) {
+        CanShardsStop(b);
+        goto fail;
+    }
+
+    if (b->cfg->warm) {
+        // Ports of nodes last seen here exist before they answer, so
+        // Klipper can open them right away
+        uint16_t known[PORTS_PER_BUS];
+        uint8_t uuids[PORTS_PER_BUS][CAN_UUID_SIZE];
+        int n = PnPorts(b->ifname, known, uuids, PORTS_PER_BUS);
+        for (int i = 0; i < n; i++)
+            CanVport(b, known[i], uuids[i], 0, PORT_WARM);
+        CanSetFilters(b);
+    }
+
+    // Create CAN RX and TX threads, optionally on their own core and
+    // under SCHED_FIFO
+    pthread_attr_t attr;
+    CanThreadAttr(b, &attr, 1);
+    retval = CanThreadStart(b, &attr, &b->RxTh, CanRxThread, b);
+    if (retval == 0) {
+        retval = pthread_create( &b->TxTh, &attr, CanTxThread, b);
+        if (retval) {
+            // The RX thread stops the workers and closes the ports
+            atomic_store(&b->threadexit, 1);
+            CanWake(b);
+            pthread_join(b->RxTh, NULL);
+        }
+    } else {
+        CanShardsStop(b);
+        CanPortsClose(b);
+    }
+    pthread_attr_destroy(&attr);
+    if (retval)
+        goto fail;
+
+    // Nodes of this bus still holding an address from before we started
+    // are filtered out, ask them to reset and pick it up again
+    uint16_t known[PORTS_PER_BUS];
+    int n = PnPorts(b->ifname, known, NULL, PORTS_PER_BUS);
+    for (int i = 0; i < n; i++) {
+        if (known[i] <= b->cfg->id_ports)
+            CanPortReset(b, CanPortCanid(b, known[i]));
+    }
+    return 0;
+
+fail:
+    CanBusFree(b);
+    return retval;
+}
+
+// Serve every port and discovery deadline that has passed, returns the
+// CLOCK_MONOTONIC time in ns of the next one
+uint64_t CanPing(tCanCtx *ctx)
+{
+    uint64_t now = CanNow();
+    uint64_t next = now + ctx->cfg.discover_max_ms * 1000000ULL;
+
+    for (int i = 0; i < ctx->nbuses; i++) {
+        uint64_t n = CanBusPing(&ctx->buses[i], now);
+        if (n < next)
+            next = n;
+    }
+    return next;
+}
+
+void CanCfgDefaults(tCanCfg *c)
+{
+    memset(c, 0, sizeof(*c));
+    c->nbus = 1;
+    c->ifname[0] = "can0";
+    c->cpu[0] = -1;
+    c->ping_ms = 1000;
+    c->discover_min_ms = 100;
+    c->discover_max_ms = 3000;
+    c->pty = 1;
+    c->maxports = 64;
+    c->ptypool = 4;
+    c->spin_us = CAN_SPIN_US;
+    c->id_base = PKT_ID_CTL_FILTER;
+}
+
+int CanSockInit(const tCanCfg *c, tCanCtx **pctx)
+{
+    int retval = 0;
+    tCanCtx *ctx;
+
+    *pctx = NULL;
+    ctx = calloc(1, sizeof(tCanCtx));
+    if (!ctx)
+        return ENOMEM;
+    ctx->cfg = *c;
+    ProfClockStart(&ctx->profclock);
+    if (ctx->cfg.maxports < 1 || ctx->cfg.maxports > (int)PORTS_PER_BUS - 1)
+        ctx->cfg.maxports = PORTS_PER_BUS - 1;
+    if (ctx->cfg.shards < 0)
+        ctx->cfg.shards = 0;
+    if (ctx->cfg.shards > CAN_MAX_SHARDS)
+        ctx->cfg.shards = CAN_MAX_SHARDS;
+    // Everything allocated from here on is locked and faulted in right
+    // away, so the data path never waits for a page
+    if (ctx->cfg.mlock && mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+        perror("mlockall");
+    PnInit(ctx->cfg.registry);
+    // Port numbers follow the ID range, those whose IDs the handshake
+    // uses are never handed out
+    if (!ctx->cfg.id_eff && (ctx->cfg.id_base < 0 ||
+                             ctx->cfg.id_base > (int)CAN_SFF_MASK - 3)) {
+        fprintf(stderr, "CAN ID base 0x%x out of range\n", ctx->cfg.id_base);
+        free(ctx);
+        return EINVAL;
+    }
+    int nports = ctx->cfg.id_eff ? CAN_MAX_PORT :
+        (CAN_SFF_MASK - 1 - ctx->cfg.id_base) / 2;
+    if (ctx->cfg.id_ports < 1 || ctx->cfg.id_ports > nports)
+        ctx->cfg.id_ports = nports;
+    PnRange(ctx->cfg.id_ports);
+    for (int i = 1; !ctx->cfg.id_eff && i <= ctx->cfg.id_ports; i++) {
+        unsigned id = ctx->cfg.id_base + 2*i;
+        if ((id & ~3u) == PKT_ID_UUID_FILTER ||
+            ((id + 1) & ~3u) == PKT_ID_UUID_FILTER)
+            PnReserve(i);
+    }
+    if (ctx->cfg.idmap && PnLoadMap(ctx->cfg.idmap) < 0) {
+        free(ctx);
+        return EINVAL;
+    }
+    if (!ctx->cfg.pty || ctx->cfg.ptypool < 0)
+        ctx->cfg.ptypool = 0;
+    if (ctx->cfg.ptypool > PTY_POOL_MAX)
+        ctx->cfg.ptypool = PTY_POOL_MAX;
+    pthread_mutex_init(&ctx->ptylock, NULL);
+    pthread_mutex_init(&ctx->ctllock, NULL);
+    pthread_cond_init(&ctx->ctlcond, NULL);
+    CanPtyFill(ctx);
+    if (ctx->cfg.capture) {
+        // Interfaces are known before the threads that capture start
+        int nbus = ctx->cfg.nbus < CAN_MAX_BUSES ? ctx->cfg.nbus :
+            CAN_MAX_BUSES;
+        ctx->cap = CapOpen(ctx->cfg.capture, nbus, ctx->cfg.ifname);
+        if (!ctx->cap) {
+            retval = errno ? errno : EIO;
+            CanSockClose(ctx);
+            return retval;
+        }
+    }
+    // Normal priority on purpose, it must not compete with the bus
+    // threads
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (ctx->cfg.mlock)
+        pthread_attr_setstacksize(&attr, CAN_THREAD_STACK);
+    retval = pthread_create(&ctx->CtlTh, &attr, CanCtlThread, ctx);
+    pthread_attr_destroy(&attr);
+    if (retval) {
+        CanSockClose(ctx);
+        return retval;
+    }
+    ctx->ctlrun = 1;
+    for (int i = 0; i < ctx->cfg.nbus && i < CAN_MAX_BUSES; i++) {
+        tCanBus *b = &ctx->buses[i];
+        snprintf(b->ifname, sizeof(b->ifname), "%s", ctx->cfg.ifname[i]);
+        b->index = i;
+        b->ctx = ctx;
+        b->cfg = &ctx->cfg;
+        b->cpu = ctx->cfg.cpu[i];
+        b->discover_ns = ctx->cfg.discover_min_ms * 1000000ULL;
+        retval = CanBusInit(b);
+        if (retval) {
+            fprintf(stderr, "%s: init failed\n", b->ifname);
+            break;
+        }
+        ctx->nbuses++;
+    }
+    // Busses already running are handed out anyway, CanSockClose
+    // stops them
+    *pctx = ctx;
+    return retval;
+}
+
+void CanSockClose(tCanCtx *ctx)
+{
+    if (!ctx)
+        return;
+    // Requests still queued are dropped, the RX threads close their
+    // half made slots on exit
+    if (ctx->ctlrun) {
+        pthread_mutex_lock(&ctx->ctllock);
+        ctx->ctlexit = 1;
+        pthread_cond_signal(&ctx->ctlcond);
+        pthread_mutex_unlock(&ctx->ctllock);
+        pthread_join(ctx->CtlTh, NULL);
+    }
+    for (int i = 0; i < ctx->nbuses; i++) {
+        tCanBus *b = &ctx->buses[i];
+        atomic_store(&b->threadexit, 1);
+        CanWake(b);
+        TxqKick(b->txq);
+        pthread_join( b->RxTh, NULL);
+        pthread_join( b->TxTh, NULL);
+        tTxStats *st = &b->txstats;
+        printf("%s TX frames %llu drops %llu errors %llu max depth %zu "
+               "queued avg %llu us max %llu us\n", b->ifname,
+               (unsigned long long)CntGet(&st->frames),
+               (unsigned long long)atomic_load(&b->txdrops),
+               (unsigned long long)CntGet(&st->errors),
+               (size_t)CntGet(&st->max_depth),
+               (unsigned long long)(CntGet(&st->frames) ?
+                   CntGet(&st->queued_ns) / CntGet(&st->frames) / 1000 : 0),
+               (unsigned long long)(CntGet(&st->max_queued_ns) / 1000));
+        char name[IFNAMSIZ + 16];
+        snprintf(name, sizeof(name), "%s RX dispatch", b->ifname);
+        HistoPrint(stdout, name, &b->rxdispatch);
+        snprintf(name, sizeof(name), "%s TX queued", b->ifname);
+        HistoPrint(stdout, name, &b->txqueued);
+        CanBusFree(b);
+    }
+    for (int i = 0; i <= CAN_MAX_PORT; i++)
+        free(atomic_load(&ctx->hooks[i]));
+    for (int i = 0; i < ctx->nptys; i++) {
+        close(ctx->ptys[i][0]);
+        close(ctx->ptys[i][1]);
+    }
+    PnSync();
+    // Threads are gone, nothing appends any more
+    CapClose(ctx->cap);
+    pthread_mutex_destroy(&ctx->ptylock);
+    pthread_mutex_destroy(&ctx->ctllock);
+    pthread_cond_destroy(&ctx->ctlcond);
+    free(ctx);
+}
+
+// Attach to a port by number, cb gets its data on the RX thread of
+// the bus the node is on, or the worker serving the port with
+// cfg.shards. The node does not need to be there yet.
+tCanPort *CanPortOpen(tCanCtx *ctx, int port, tCanRxCb cb, void *arg)
+{
+    tCanPort *h, *none = NULL;
+
+    if (port < 0 || port > CAN_MAX_PORT || !cb) {
+        errno = EINVAL;
+        return NULL;
+    }
+    h = malloc(sizeof(tCanPort));
+    if (!h) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    h->ctx = ctx;
+    h->port = port;
+    h->cb = cb;
+    h->arg = arg;
+    if (!atomic_compare_exchange_strong(&ctx->hooks[port], &none, h)) {
+        free(h);
+        errno = EBUSY;
+        return NULL;
+    }
+    return h;
+}
+
+// Queue data for the node from any thread but a callback, cut into
+// frames like pty data. ENOTCONN while the node is not assigned,
+// ENOBUFS with nothing queued when the credit or the TX queue is short.
+// Frames of concurrent writers never interleave. Not atomic with the
+// port itself: a node dropped after the check still gets the frames
+// on its old ID.
+int CanPortWrite(tCanPort *h, const uint8_t *data, int len)
+{
+    tCanCtx *ctx = h->ctx;
+    canid_t canid;
+    int fdmode;
+
+    int w = atomic_load(&ctx->where[h->port]);
+    if (!w)
+        return ENOTCONN;
+    tCanBus *b = &ctx->buses[WHERE_BUS(w)];
+    tPortId *p = &b->ports.p[WHERE_SLOT(w)];
+    if (CanPortSnapshot(p, &canid, &fdmode) != PORT_ACTIVE)
+        return ENOTCONN;
+    // All or nothing, a partial message would only confuse the node:
+    // the credit and every queue cell are taken before the first frame
+    // is written
+    int frames = 0;
+    for (int left = len; left > 0; frames++)
+        left -= fdmode ? CanFdLen(left) :
+            (left > CAN_DATA_SIZE ? CAN_DATA_SIZE : left);
+    if (frames == 0)
+        return 0;
+    if (CanCreditTake(p, len, len) == 0)
+        return ENOBUFS;
+    size_t pos;
+    if (TxqReserve(b->txq, frames, &pos) < 0) {
+        CanCreditGive(p, len);
+        return ENOBUFS;
+    }
+    for (int i = 0; i < frames; i++) {
+        tTxEntry tx;
+        int n = fdmode ? CanFdLen(len) :
+            (len > CAN_DATA_SIZE ? CAN_DATA_SIZE : len);
+        CanTxEntry(&tx, canid, n, data, fdmode, 0, NULL);
+        TxqPut(b->txq, pos, i, &tx);
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Detach, once it returns cb is not running and won't be called again.
+// Not to be called from a callback.
+void CanPortClose(tCanPort *h)
+{
+    tCanCtx *ctx = h->ctx;
+
+    atomic_store(&ctx->hooks[h->port], NULL);
+    for (int i = 0; i < ctx->nbuses; i++) {
+        tCanBus *b = &ctx->buses[i];
+        unsigned epoch = atomic_load_explicit(&b->rxepoch,
+                                              memory_order_acquire);
+        CanWake(b);
+        while (atomic_load_explicit(&b->rxepoch, memory_order_acquire) ==
+               epoch && !atomic_load(&b->threadexit))
+            usleep(100);
+        for (int k = 0; k < b->nshards; k++) {
+            tCanShard *s = &b->shards[k];
+            epoch = atomic_load_explicit(&s->epoch, memory_order_acquire);
+            CanShardWake(s);
+            while (atomic_load_explicit(&s->epoch, memory_order_acquire) ==
+                   epoch && !atomic_load(&s->exit))
+                usleep(100);
+        }
+    }
+    free(h);
+}
+
+// Look for new nodes right away as after a port change
+void CanDiscover(tCanCtx *ctx)
+{
+    for (int i = 0; i < ctx->nbuses; i++)
+        atomic_store(&ctx->buses[i].topology, 1);
+}
+
+// Close the port of a node as if it had gone silent
+int CanPortDrop(tCanCtx *ctx, int port)
+{
+    canid_t canid;
+    int expected = PORT_ACTIVE;
+
+    if (port < 0 || port > CAN_MAX_PORT)
+        return EINVAL;
+    int w = atomic_load(&ctx->where[port]);
+    if (!w)
+        return ENOTCONN;
+    tCanBus *b = &ctx->buses[WHERE_BUS(w)];
+    tPortId *p = &b->ports.p[WHERE_SLOT(w)];
+    if (CanPortSnapshot(p, &canid, NULL) != PORT_ACTIVE ||
+        !atomic_compare_exchange_strong(&p->state, &expected, PORT_RETIRE))
+        return ENOTCONN;
+    atomic_store(&b->topology, 1);
+    CanWake(b);
+    return 0;
+}
+
+static const char *CanStateName(int state)
+{
+    switch (state) {
+    case PORT_WARM: return "warm";
+    case PORT_ACTIVE: return "active";
+    case PORT_RETIRE: return "retire";
+    case PORT_PROVISION: return "provision";
+    case PORT_CLOSING: return "closing";
+    }
+    return "free";
+}
+
+// One counter over all busses or ports in Prometheus text format
+#define PROM_HEAD(f, name, type, help) \
+    fprintf(f, "# HELP canserial_%s %s\n# TYPE canserial_%s %s\n", \
+            name, help, name, type)
+
+// Dump all counters, aggregated from the threads writing them, as text or
+// Prometheus exposition format. Rates cover the time since the last call.
+void CanStatsWrite(tCanCtx *ctx, FILE *f, int prom)
+{
+    uint64_t now = CanNow();
+
+    for (int i = 0; i < ctx->nbuses; i++) {
+        tCanBus *b = &ctx->buses[i];
+        tRxStats *rs = &b->rxstats;
+        tTxStats *ts = &b->txstats;
+        uint64_t rxw = CntGet(&rs->wakeups), txw = CntGet(&ts->wakeups);
+        double dt = b->statsat ? (now - b->statsat) / 1e9 : 0;
+        double rxrate = dt > 0 ? (rxw - b->rxwakeups) / dt : 0;
+        double txrate = dt > 0 ? (txw - b->txwakeups) / dt : 0;
+        b->statsat = now;
+        b->rxwakeups = rxw;
+        b->txwakeups = txw;
+
+        if (prom) {
+            if (i == 0) {
+                PROM_HEAD(f, "bus_rx_frames_total", "counter", "Frames received");
+                PROM_HEAD(f, "bus_tx_frames_total", "counter", "Frames sent");
+                PROM_HEAD(f, "bus_tx_drops_total", "counter", "Frames lost to a full TX queue");
+                PROM_HEAD(f, "bus_tx_errors_total", "counter", "Failed frame writes");
+                PROM_HEAD(f, "bus_error_frames_total", "counter", "CAN error frames");
+                PROM_HEAD(f, "bus_busoff_total", "counter", "Bus-off events");
+                PROM_HEAD(f, "bus_state", "gauge", "0 ok, 1 error passive, 2 bus-off");
+                PROM_HEAD(f, "bus_outage_seconds_total", "counter", "Time spent bus-off");
+                PROM_HEAD(f, "bus_tx_retries_total", "counter", "Writes put off for a full interface queue");
+                PROM_HEAD(f, "bus_rx_wakeups_total", "counter", "RX thread wakeups");
+                PROM_HEAD(f, "bus_tx_wakeups_total", "counter", "TX thread wakeups");
+                PROM_HEAD(f, "bus_tx_queue_depth", "gauge", "Frames in the TX queue");
+                if (ctx->cfg.shards) {
+                    PROM_HEAD(f, "shard_msgs_total", "counter", "Frames and commands run by a worker");
+                    PROM_HEAD(f, "shard_drops_total", "counter", "Frames lost to a full worker queue");
+                    PROM_HEAD(f, "shard_wakeups_total", "counter", "Worker wakeups");
+                    PROM_HEAD(f, "shard_queue_depth", "gauge", "Entries waiting for a worker");
+                }
+            }
+#define PROM_BUS(name, v) \
+    fprintf(f, "canserial_%s{bus=\"%s\"} %llu\n", name, b->ifname, \
+            (unsigned long long)(v))
+            PROM_BUS("bus_rx_frames_total", CntGet(&rs->frames));
+            PROM_BUS("bus_tx_frames_total", CntGet(&ts->frames));
+            PROM_BUS("bus_tx_drops_total", atomic_load(&b->txdrops));
+            PROM_BUS("bus_tx_errors_total", CntGet(&ts->errors));
+            PROM_BUS("bus_error_frames_total", CntGet(&rs->errframes));
+            PROM_BUS("bus_busoff_total", CntGet(&rs->busoff));
+            PROM_BUS("bus_state", atomic_load(&b->busstate));
+            fprintf(f, "canserial_bus_outage_seconds_total{bus=\"%s\"} %.3f\n",
+                    b->ifname, CntGet(&rs->outage_ns) / 1e9);
+            PROM_BUS("bus_tx_retries_total", CntGet(&ts->retries));
+            PROM_BUS("bus_rx_wakeups_total", rxw);
+            PROM_BUS("bus_tx_wakeups_total", txw);
+            PROM_BUS("bus_tx_queue_depth", TxqDepth(b->txq));
+#undef PROM_BUS
+        } else {
+            fprintf(f, "bus %s state %s rx %llu tx %llu txdrops %llu "
+                    "txerrors %llu txretries %llu errframes %llu busoff %llu "
+                    "outage %.3f s txq %zu "
+                    "rxwakeups/s %.1f txwakeups/s %.1f\n", b->ifname,
+                    busstates[atomic_load(&b->busstate)],
+                    (unsigned long long)CntGet(&rs->frames),
+                    (unsigned long long)CntGet(&ts->frames),
+                    (unsigned long long)atomic_load(&b->txdrops),
+                    (unsigned long long)CntGet(&ts->errors),
+                    (unsigned long long)CntGet(&ts->retries),
+                    (unsigned long long)CntGet(&rs->errframes),
+                    (unsigned long long)CntGet(&rs->busoff),
+                    CntGet(&rs->outage_ns) / 1e9,
+                    TxqDepth(b->txq), rxrate, txrate);
+        }
+        for (int k = 0; k < b->nshards; k++) {
+            tCanShard *s = &b->shards[k];
+            unsigned depth = atomic_load(&s->head) - atomic_load(&s->tail);
+            if (prom) {
+#define PROM_SHARD(name, v) \
+    fprintf(f, "canserial_%s{bus=\"%s\",shard=\"%d\"} %llu\n", name, \
+            b->ifname, k, (unsigned long long)(v))
+                PROM_SHARD("shard_msgs_total", CntGet(&s->msgs));
+                PROM_SHARD("shard_drops_total", CntGet(&s->drops));
+                PROM_SHARD("shard_wakeups_total", CntGet(&s->wakeups));
+                PROM_SHARD("shard_queue_depth", depth);
+#undef PROM_SHARD
+            } else {
+                fprintf(f, "shard %d bus %s msgs %llu drops %llu wakeups %llu "
+                        "queue %u\n", k, b->ifname,
+                        (unsigned long long)CntGet(&s->msgs),
+                        (unsigned long long)CntGet(&s->drops),
+                        (unsigned long long)CntGet(&s->wakeups), depth);
+            }
+        }
+    }
+
+    if (prom) {
+        PROM_HEAD(f, "port_frames_in_total", "counter", "Frames from the node");
+        PROM_HEAD(f, "port_bytes_in_total", "counter", "Bytes from the node");
+        PROM_HEAD(f, "port_frames_out_total", "counter", "Frames sent to the node");
+        PROM_HEAD(f, "port_bytes_out_total", "counter", "Bytes read from the host");
+        PROM_HEAD(f, "port_drops_total", "counter", "Bytes the host had no room for");
+        PROM_HEAD(f, "port_tx_queued", "gauge", "Frames waiting to be sent");
+        PROM_HEAD(f, "port_ping_misses_total", "counter", "Pings sent to the silent node");
+        PROM_HEAD(f, "port_last_seen_seconds", "gauge", "Time since the last frame");
+        PROM_HEAD(f, "port_active", "gauge", "Node assigned and alive");
+        PROM_HEAD(f, "port_open", "gauge", "Host has the port open");
+    }
+    for (int i = 0; i < ctx->nbuses; i++) {
+        tCanBus *b = &ctx->buses[i];
+        int ptr = atomic_load(&b->ports.portptr);
+
+        for (int j = 1; j < ptr; j++) {
+            tPortId *p = &b->ports.p[j];
+            canid_t canid;
+            int state = CanPortSnapshot(p, &canid, NULL);
+            if (state == PORT_FREE)
+                continue;
+            int port = p->port;
+            uint64_t queued = CntGet(&p->rxc.frames_queued);
+            uint64_t out = CntGet(&p->tx.frames);
+            queued = queued > out ? queued - out : 0;
+            uint64_t lastrx = atomic_load(&p->lastrx);
+            double seen = now > lastrx ? (now - lastrx) / 1e9 : 0;
+            int open = p->active || p->csock >= 0 ||
+                (port <= CAN_MAX_PORT && atomic_load(&ctx->hooks[port]));
+            // the slot may have been reused meanwhile
+            if (CanPortSnapshot(p, &canid, NULL) != state)
+                continue;
+
+            if (prom) {
+#define PROM_PORT(name, fmt, v) \
+    fprintf(f, "canserial_%s{bus=\"%s\",port=\"%d\"} " fmt "\n", name, \
+            b->ifname, port, v)
+                PROM_PORT("port_frames_in_total", "%llu",
+                          (unsigned long long)CntGet(&p->rxc.frames_in));
+                PROM_PORT("port_bytes_in_total", "%llu",
+                          (unsigned long long)CntGet(&p->rxc.bytes_in));
+                PROM_PORT("port_frames_out_total", "%llu",
+                          (unsigned long long)out);
+                PROM_PORT("port_bytes_out_total", "%llu",
+                          (unsigned long long)CntGet(&p->rxc.bytes_out));
+                PROM_PORT("port_drops_total", "%llu",
+                          (unsigned long long)CntGet(&p->rxc.drops));
+                PROM_PORT("port_tx_queued", "%llu",
+                          (unsigned long long)queued);
+                PROM_PORT("port_ping_misses_total", "%llu",
+                          (unsigned long long)CntGet(&p->pingmiss));
+                PROM_PORT("port_last_seen_seconds", "%.3f", seen);
+                PROM_PORT("port_active", "%d", state == PORT_ACTIVE);
+                PROM_PORT("port_open", "%d", open);
+#undef PROM_PORT
+            } else {
+                fprintf(f, "port %d bus %s canid %03x %s%s in %llu frames "
+                        "%llu bytes out %llu frames %llu bytes queued %llu "
+                        "drops %llu pingmiss %llu lastseen %.3f s\n",
+                        port, b->ifname, canid, CanStateName(state),
+                        open ? " open" : "",
+                        (unsigned long long)CntGet(&p->rxc.frames_in),
+                        (unsigned long long)CntGet(&p->rxc.bytes_in),
+                        (unsigned long long)out,
+                        (unsigned long long)CntGet(&p->rxc.bytes_out),
+                        (unsigned long long)queued,
+                        (unsigned long long)CntGet(&p->rxc.drops),
+                        (unsigned long long)CntGet(&p->pingmiss), seen);
+            }
+        }
+    }
+}
+
+void CanProfileWrite(tCanCtx *ctx, FILE *f)
+{
+    char name[IFNAMSIZ + 16];
+
+    if (!ctx->cfg.profile) {
+        fprintf(f, "profiling is off\n");
+        return;
+    }
+    double hz = ProfClockHz(&ctx->profclock);
+    uint64_t up = ProfTicks() - ctx->profclock.ticks;
+    fprintf(f, "profile %.1f s at %.0f MHz\n", up / hz, hz / 1e6);
+    for (int i = 0; i < ctx->nbuses; i++) {
+        tCanBus *b = &ctx->buses[i];
+
+        snprintf(name, sizeof(name), "%s rx", b->ifname);
+        ProfPrint(f, name, &b->rxprof, CanProfNames, PROF_STAGES, hz, up);
+        for (int k = 0; k < b->nshards; k++) {
+            snprintf(name, sizeof(name), "%s shard%d", b->ifname, k);
+            ProfPrint(f, name, &b->shards[k].prof, CanProfNames,
+                      PROF_STAGES, hz, up);
+        }
+        snprintf(name, sizeof(name), "%s tx", b->ifname);
+        ProfPrint(f, name, &b->txprof, CanProfNames, PROF_STAGES, hz, up);
+    }
+    ProfPrint(f, "control", &ctx->ctlprof, CanProfNames, PROF_STAGES, hz, up);
+}
+
+static int CanTxClass(canid_t id, uint8_t len)
+{
+    // credit grants go first too, a node waiting for them is idle
+    if (id == PKT_ID_UUID || id == PKT_ID_SET || (id & CAN_RTR_FLAG))
+        return TXC_CONTROL;
+    return len ? TXC_DATA : TXC_PING;
+}
+
+static void CanTxEntry(tTxEntry *tx, canid_t id, uint8_t len,
+                       const uint8_t *data, int fd, uint64_t born,
+                       tTxAcct *acct)
+{
+    memset(&tx->frame, 0, sizeof(tx->frame));
+    tx->frame.can_id = id;
+    tx->frame.len = len;
+    if (fd) {
+        tx->frame.flags = CANFD_BRS;
+        tx->mtu = CANFD_MTU;
+    } else {
+        tx->mtu = CAN_MTU;
+    }
+    if (len)
+        memcpy(tx->frame.data, data, len);
+    tx->cls = CanTxClass(id, len);
+    tx->queued = CanNow();
+    tx->born = born ? born : tx->queued;
+    tx->acct = acct;
+}
+
+static int CanSockQueue(tCanBus *b, canid_t id, uint8_t len, uint8_t* data,
+                        int fd, uint64_t born, tTxAcct *acct)
+{
+    tTxEntry tx;
+    uint64_t t0 = CanProfIn();
+    int r = 0;
+
+    CanTxEntry(&tx, id, len, data, fd, born, acct);
+    if (TxqPush(b->txq, &tx) < 0) {
+        atomic_fetch_add_explicit(&b->txdrops, 1, memory_order_relaxed);
+        r = ENOBUFS;
+    }
+    CanProfOut(PROF_SEND, t0);
+    return r;
+}
+
+// Queue one frame for transmission from any thread without blocking,
+// the bus TX thread writes it out.
+int CanSockSend(tCanBus *b, canid_t id, uint8_t len, uint8_t* data)
+{
+    if (len>8){	
+        fprintf(stderr, "CanSockSend(%d, %d) EINVAL\n", id, len); 
+        return EINVAL;
+    }
+    return CanSockQueue(b, id, len, data, 0, 0, NULL);
+}
+
+// Same as CanSockSend for a CAN FD frame with bit rate switch,
+// len must be a valid FD payload length
+int CanSockSendFd(tCanBus *b, canid_t id, uint8_t len, uint8_t* data)
+{
+    if (len>CANFD_DATA_SIZE || CanFdLen(len) != len) {
+        fprintf(stderr, "CanSockSendFd(%d, %d) EINVAL\n", id, len);
+        return EINVAL;
+    }
+    return CanSockQueue(b, id, len, data, 1, 0, NULL);
+}
+
+// Transmit order: class first, then arbitration ID, then queue order
+static int CanTxBefore(const tTxEntry *a, const tTxEntry *b)
+{
+    if (a->cls != b->cls)
+        return a->cls < b->cls;
+    canid_t ia = a->frame.can_id & CAN_EFF_MASK;
+    canid_t ib = b->frame.can_id & CAN_EFF_MASK;
+    if (ia != ib)
+        return ia < ib;
+    return a->seq < b->seq;
+}
+
+// Binary min-heap of frames waiting for the socket
+typedef struct {
+    tTxEntry e[CAN_TX_PENDING];
+    int n;
+} tTxHeap;
+
+static void CanTxHeapPush(tTxHeap *h, const tTxEntry *e)
+{
+    int i = h->n++;
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!CanTxBefore(e, &h->e[parent]))
+            break;
+        h->e[i] = h->e[parent];
+        i = parent;
+    }
+    h->e[i] = *e;
+}
+
+static void CanTxHeapPop(tTxHeap *h, tTxEntry *out)
+{
+    tTxEntry last = h->e[--h->n];
+    int i = 0;
+
+    *out = h->e[0];
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= h->n)
+            break;
+        if (c + 1 < h->n && CanTxBefore(&h->e[c + 1], &h->e[c]))
+            c++;
+        if (!CanTxBefore(&h->e[c], &last))
+            break;
+        h->e[i] = h->e[c];
+        i = c;
+    }
+    if (h->n)
+        h->e[i] = last;
+}
+
+// Keeps the kernel queue topped up. Only this thread writes to the
+// socket, so blocking on a full qdisc delays nobody else.
+// Watch the TX queue until the spin window closes, 1 once it has
+// entries or the thread is to exit
+static int CanTxSpin(tCanBus *b, uint64_t until)
+{
+    while (CanNow() < until) {
+        if (TxqDepth(b->txq) || atomic_load(&b->threadexit))
+            return 1;
+        CanRelax();
+    }
+    return 0;
+}
+
+static void *CanTxThread(void *ptr)
+{
+    tCanBus *b = ptr;
+    const int spin = b->cfg->wait == CAN_WAIT_SPIN;
+    uint64_t spinuntil = 0;
+    tTxHeap heap;
+    tTxEntry batch[CAN_TX_BATCH];
+    struct mmsghdr msgs[CAN_TX_BATCH];
+    struct iovec iovs[CAN_TX_BATCH];
+    tTxEntry e;
+    tTxStats *st = &b->txstats;
+    uint64_t t0;
+
+    if (b->cfg->profile)
+        CanProf = &b->txprof;
+    heap.n = 0;
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < CAN_TX_BATCH; i++) {
+        iovs[i].iov_base = &batch[i].frame;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (atomic_load(&b->threadexit) == 0) {
+        size_t depth = TxqDepth(b->txq);
+        CntMax(&st->max_depth, depth);
+
+        while (heap.n < CAN_TX_PENDING && TxqPop(b->txq, &e) == 0)
+            CanTxHeapPush(&heap, &e);
+
+        if (atomic_load(&b->txthrottled) && depth < TXQ_SIZE / 2) {
+            atomic_store(&b->txthrottled, 0);
+            atomic_store(&b->txresume, 1);
+            CanWake(b);
+        }
+
+        if (heap.n == 0) {
+            t0 = CanProfIn();
+            int more = spin && CanTxSpin(b, spinuntil);
+            if (!more) {
+                TxqWait(b->txq);
+                CntAdd(&st->wakeups, 1);
+            }
+            CanProfOut(PROF_TXWAIT, t0);
+            continue;
+        }
+
+        if (atomic_load(&b->busstate) == BUS_OFF) {
+            // Frames wait in the queue and the ports throttle, a try now
+            // and then notices when the controller is back
+            struct timespec probe = { 0, BUS_PROBE_MS * 1000000L };
+            nanosleep(&probe, NULL);
+        }
+
+        int n = 0;
+        while (n < CAN_TX_BATCH && heap.n) {
+            CanTxHeapPop(&heap, &batch[n]);
+            iovs[n].iov_len = batch[n].mtu;
+            n++;
+        }
+
+        int sent = 0;
+        t0 = CanProfIn();
+        while (sent < n) {
+            int r = sendmmsg(b->sock, &msgs[sent], n - sent, 0);
+            if (r < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == ENOBUFS || errno == ENETDOWN) {
+                    // Interface queue full or bus gone, keep the rest
+                    // for later instead of losing it
+                    for (int i = sent; i < n; i++)
+                        CanTxHeapPush(&heap, &batch[i]);
+                    CntAdd(&st->retries, 1);
+                    usleep(TX_RETRY_US);
+                    break;
+                }
+                perror("CAN write");
+                CntAdd(&st->errors, n - sent);
+                break;
+            }
+            sent += r;
+        }
+        CanProfOut(PROF_TXWRITE, t0);
+
+        tCapture *cap = b->ctx->cap;
+        if (cap) {
+            uint64_t ts = CanRealNow();
+            for (int i = 0; i < sent; i++)
+                CapFrame(cap, b->index, CAP_TX, &batch[i].frame,
+                         batch[i].mtu, ts);
+        }
+
+        uint64_t now = CanNow();
+        for (int i = 0; i < sent; i++) {
+            uint64_t q = now - batch[i].queued;
+            CntAdd(&st->queued_ns, q);
+            CntMax(&st->max_queued_ns, q);
+            HistoRecord(&b->txqueued, q);
+            tTxAcct *acct = batch[i].acct;
+            if (acct) {
+                CntAdd(&acct->frames, 1);
+                CntAdd(&acct->bytes, batch[i].frame.len);
+                HistoRecord(&acct->lat, now - batch[i].born);
+            }
+        }
+        if (sent > 0)
+            CntAdd(&st->frames, sent);
+        if (spin)
+            spinuntil = now + b->cfg->spin_us * 1000ULL;
+    }
+    return NULL;
+}
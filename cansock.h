@@ -1,6 +1,8 @@
 #ifndef CANSOCK_H_
 #define CANSOCK_H_
 
+#include <stdio.h>
+#include <stdint.h>
 #include <linux/can.h>
 
 // Read UUID or reset MCU (6bytes)
@@ -9,26 +11,171 @@
 #define PKT_ID_SET (0x322)
 // UUID response from slave  (6bytes)
 #define PKT_ID_UUID_RESP (0x323)
+// Optional 7th byte of the UUID response, capabilities of the slave
+#define CAN_CAP_FD (0x01)
+// Slave takes part in credit flow control
+#define CAN_CAP_CREDIT (0x02)
+// Slave has an ISO-TP bulk channel
+#define CAN_CAP_BULK (0x04)
+// Slave takes a port on 29 bit IDs
+#define CAN_CAP_EFF (0x08)
+// Set in the PKT_ID_SET address when the port uses CAN FD data frames
+#define PKT_SET_FD (0x8000)
+// Set in the PKT_ID_SET address when the port uses credit flow control
+#define PKT_SET_CREDIT (0x4000)
+// Set in the PKT_ID_SET address when the bulk channel is open
+#define PKT_SET_BULK (0x2000)
+// Set in the PKT_ID_SET address when the port uses 29 bit IDs, the
+// address bits below are the port number and the host sends to the
+// node on CAN_EFF_ID(port), the node answers on the next ID
+#define PKT_SET_EFF (0x1000)
+#define PKT_ID_EFF (0x1E000000)
+#define CAN_EFF_ID(port) (CAN_EFF_FLAG | PKT_ID_EFF | ((port) << 1))
+// ISO-TP bulk channel of a port on 29 bit IDs, host -> node, the node
+// answers on the next ID
+#define PKT_ID_BULK (0x1F000000)
+#define CAN_BULK_ID(port) (CAN_EFF_FLAG | PKT_ID_BULK | ((port) << 1))
+// Largest bulk message, the classic ISO-TP limit
+#define CAN_BULK_MAX (4095)
+// Credit grants are remote frames on the data ID, DLC n gives the other
+// side n * CAN_CREDIT_UNIT more bytes to send
+#define CAN_CREDIT_UNIT (64)
 #define PKT_ID_UUID_FILTER (0x320)
 #define PKT_ID_UUID_MASK (0xFFFC)
-// ID's starts from this number
+// ID's starts from this number by default, port n sends on
+// PKT_ID_CTL_FILTER + 2n + 1
 #define PKT_ID_CTL_FILTER (0x180)
-// And total 127 ports max
-#define PKT_ID_CTL_MASK (0xFF80)
-#define NUM_CAN_FILTERS 2
 
 #define CAN_DATA_SIZE (8)
+#define CANFD_DATA_SIZE (64)
 #define CAN_UUID_SIZE (6)
 
 
 #define PINGS_BEFORE_DISCONNECT 4
+#define CAN_MAX_BUSES 4
+// Most worker threads per bus, cfg.shards
+#define CAN_MAX_SHARDS 16
+// Highest port number the PKT_ID_SET address has room for, standard
+// IDs end at (CAN_SFF_MASK - 1 - id_base) / 2
+#define CAN_MAX_PORT (0xFFF)
 
-typedef struct can_frame tCanFrame;
+// How the RX and TX threads wait for work
+enum {
+    CAN_WAIT_BLOCK = 0, // sleep in epoll_wait, least CPU
+    CAN_WAIT_BUSYPOLL, // SO_BUSY_POLL on the CAN socket, NAPI drivers
+    CAN_WAIT_SPIN // poll without sleeping for spin_us after any work
+};
 
+// Classic CAN frames are read and written through the FD layout too
+typedef struct canfd_frame tCanFrame;
 
-int  CanSockInit(void);
-void CanSockClose(void);
-int  CanSockSend(canid_t id, uint8_t len, uint8_t* data);
-void CanPing(void);
+// Node of a port came (up=1) or went (up=0), on the RX thread of its bus
+typedef void (*tCanPortEvent)(void *arg, int port, const uint8_t *uuid,
+                              int up);
+// Data from the node of an attached port, on the RX thread of its bus
+// or with cfg.shards on the worker serving the port
+typedef void (*tCanRxCb)(void *arg, const uint8_t *data, int len);
+
+typedef struct {
+    // Hold pty bytes up to this long to fill a frame, 0 sends
+    // every read immediately
+    int coalesce_us;
+    // Offer CAN FD data frames to slaves advertising CAN_CAP_FD
+    int fd;
+    // Credit flow control with slaves advertising CAN_CAP_CREDIT
+    int credit;
+    // ISO-TP bulk channel <pty link>.bulk with slaves advertising
+    // CAN_CAP_BULK, with the block size and STmin we ask them for
+    int bulk;
+    int bulk_bs;
+    int bulk_stmin;
+    // CAN interfaces to serve and the core for each RX thread (-1 any)
+    int nbus;
+    const char *ifname[CAN_MAX_BUSES];
+    int cpu[CAN_MAX_BUSES];
+    // SCHED_FIFO priority of the RX and TX threads, 0 for normal
+    int rt_prio;
+    // mlockall at init, so buffers allocated up front never fault
+    int mlock;
+    // Ports per bus with preallocated buffers (default 64)
+    int maxports;
+    // Pty pairs kept open for new ports (default 4), so a node showing
+    // up costs no openpty
+    int ptypool;
+    // CAN_WAIT_*, and the busy poll or spin window in us (default 50)
+    int wait;
+    int spin_us;
+    // Run the RX threads on io_uring where the kernel has it: multishot
+    // receive of frames and pty writes without a syscall each, epoll
+    // otherwise
+    int uring;
+    // Count the time every thread spends per stage, for
+    // CanProfileWrite. Costs two clock reads per stage run.
+    int profile;
+    // Worker threads per bus sharing out the ports: each serves the
+    // ptys, sockets and coalescing of its ports while the RX thread
+    // only reads the bus and hands frames over. 0 serves everything on
+    // the RX thread, up to CAN_MAX_SHARDS.
+    int shards;
+    // CAN IDs of the ports: port n gets id_base + 2n to the node and
+    // the next ID back (default PKT_ID_CTL_FILTER), for ports 1..id_ports
+    // (default 0, as many as there are standard IDs above id_base)
+    int id_base;
+    int id_ports;
+    // 29 bit IDs CAN_EFF_ID(n) instead, for nodes advertising CAN_CAP_EFF
+    // only, up to CAN_MAX_PORT ports
+    int id_eff;
+    // UUID -> priority class or fixed port, NULL for arrival order
+    const char *idmap;
+    // Let other local sockets see our frames (candump)
+    int loopback;
+    // Liveness: a silent node is pinged every ping_ms and dropped after
+    // PINGS_BEFORE_DISCONNECT * ping_ms without any frame from it
+    int ping_ms;
+    // Discovery broadcast interval, starts at min after every port change
+    // and doubles up to max while the bus is stable
+    int discover_min_ms;
+    int discover_max_ms;
+    // Create ptys of the nodes in the registry at startup
+    int warm;
+    // Also serve every port as a SOCK_SEQPACKET socket <pty link>.sock
+    int unixsock;
+    // Create a pty for every port, embedders using only CanPortOpen
+    // may turn it off
+    int pty;
+    // UUID to port registry, NULL for /var/tmp/canuuids.cfg
+    const char *registry;
+    // Record bus traffic and port events to this pcapng file, NULL for off
+    const char *capture;
+    // Optional port assignment notifications
+    tCanPortEvent port_event;
+    void *event_arg;
+} tCanCfg;
+
+// One CAN interface with its ports and RX thread
+typedef struct tCanBus tCanBus;
+// A bridge instance with all its busses
+typedef struct tCanCtx tCanCtx;
+// Port attached to by the embedding process
+typedef struct tCanPort tCanPort;
+
+
+void CanCfgDefaults(tCanCfg *cfg);
+int  CanSockInit(const tCanCfg *cfg, tCanCtx **ctx);
+void CanSockClose(tCanCtx *ctx);
+int  CanSockSend(tCanBus *bus, canid_t id, uint8_t len, uint8_t* data);
+int  CanSockSendFd(tCanBus *bus, canid_t id, uint8_t len, uint8_t* data);
+uint64_t CanPing(tCanCtx *ctx);
+
+tCanPort *CanPortOpen(tCanCtx *ctx, int port, tCanRxCb cb, void *arg);
+int  CanPortWrite(tCanPort *port, const uint8_t *data, int len);
+void CanPortClose(tCanPort *port);
+
+// Statistics and control, callable from any thread but one at a time
+void CanStatsWrite(tCanCtx *ctx, FILE *f, int prom);
+void CanDiscover(tCanCtx *ctx);
+int  CanPortDrop(tCanCtx *ctx, int port);
+// Time per stage and thread since init, with cfg.profile
+void CanProfileWrite(tCanCtx *ctx, FILE *f);
 
 #endif /* CANSOCK_H_ */
@@ -0,0 +1,311 @@
+/*
+ * Bus traffic capture for CanSerial, pcapng with LINKTYPE_CAN_SOCKETCAN
+ *
+ *  This file may be distributed under the terms of the GNU GPLv3 license.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+
+#include "capture.h"
+
+#define CAP_MASK (CAP_SIZE - 1)
+// File window mapped at a time, multiple of the page size
+#define CAP_MAP (4 << 20)
+
+#define LINKTYPE_CAN_SOCKETCAN 227
+#define LINKTYPE_USER0 147 // port events, text only
+
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define OPT_END 0
+#define OPT_COMMENT 1
+#define IF_NAME 2
+#define IF_TSRESOL 9
+#define EPB_FLAGS 2
+#define EPB_INBOUND 1
+#define EPB_OUTBOUND 2
+
+static uint64_t CapNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Make room for len more bytes in the mapped window
+static int CapReserve(tCapture *c, size_t len)
+{
+    if (c->map && c->off + len <= c->mapoff + CAP_MAP)
+        return 0;
+    if (c->map)
+        munmap(c->map, CAP_MAP);
+    c->map = NULL;
+    c->mapoff = c->off & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+    if (ftruncate(c->fd, c->mapoff + CAP_MAP) < 0)
+        return -1;
+    void *m = mmap(NULL, CAP_MAP, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   c->fd, c->mapoff);
+    if (m == MAP_FAILED)
+        return -1;
+    c->map = m;
+    return 0;
+}
+
+static void CapPut(tCapture *c, const void *data, size_t len)
+{
+    memcpy(c->map + (c->off - c->mapoff), data, len);
+    c->off += len;
+}
+
+static void CapPut32(tCapture *c, uint32_t v)
+{
+    CapPut(c, &v, 4);
+}
+
+static void CapPad(tCapture *c, size_t len)
+{
+    static const uint8_t zero[4];
+    CapPut(c, zero, (4 - (len & 3)) & 3);
+}
+
+static uint32_t CapOptLen(size_t len)
+{
+    return 4 + ((len + 3) & ~3);
+}
+
+static void CapOpt(tCapture *c, uint16_t code, const void *data, size_t len)
+{
+    uint16_t hdr[2] = { code, len };
+    CapPut(c, hdr, 4);
+    CapPut(c, data, len);
+    CapPad(c, len);
+}
+
+static int CapHeader(tCapture *c, int nbus, const char **ifnames)
+{
+    uint32_t shb[7] = { PCAPNG_SHB, 28, 0x1A2B3C4D, 0x00000001,
+                        0xFFFFFFFF, 0xFFFFFFFF, 28 };
+    uint8_t resol = 9; // ns
+
+    if (CapReserve(c, sizeof(shb)) < 0)
+        return -1;
+    CapPut(c, shb, sizeof(shb));
+
+    // Two interfaces per bus: frames and port events
+    for (int i = 0; i < 2 * nbus; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "%s%s", ifnames[i / 2],
+                 i & 1 ? "-events" : "");
+        uint32_t len = 20 + CapOptLen(strlen(name)) + CapOptLen(1) + 4;
+        uint16_t link[2] = { i & 1 ? LINKTYPE_USER0 : LINKTYPE_CAN_SOCKETCAN,
+                             0 };
+        uint32_t end = OPT_END;
+
+        if (CapReserve(c, len) < 0)
+            return -1;
+        CapPut32(c, PCAPNG_IDB);
+        CapPut32(c, len);
+        CapPut(c, link, 4);
+        CapPut32(c, CANFD_MTU); // snaplen
+        CapOpt(c, IF_NAME, name, strlen(name));
+        CapOpt(c, IF_TSRESOL, &resol, 1);
+        CapPut(c, &end, 4);
+        CapPut32(c, len);
+    }
+    return 0;
+}
+
+// One enhanced packet block, frames in SocketCAN layout with the
+// CAN ID in network byte order as LINKTYPE_CAN_SOCKETCAN wants it
+static int CapWriteRec(tCapture *c, const tCapRec *r)
+{
+    tCanFrame f;
+    const void *data;
+    uint32_t caplen, ifid, flags = 0;
+    size_t clen = 0;
+
+    if (r->type == CAP_EVENT) {
+        ifid = 2 * r->bus + 1;
+        clen = strnlen(r->ev, sizeof(r->ev));
+        data = r->ev;
+        caplen = clen;
+    } else {
+        ifid = 2 * r->bus;
+        f = r->frame;
+        f.can_id = htonl(f.can_id);
+        if (r->mtu == CANFD_MTU)
+            f.flags |= CANFD_FDF;
+        data = &f;
+        caplen = r->mtu;
+        flags = r->type == CAP_RX ? EPB_INBOUND : EPB_OUTBOUND;
+    }
+
+    uint32_t len = 28 + ((caplen + 3) & ~3) + 8;
+    if (flags)
+        len += CapOptLen(4);
+    if (r->type == CAP_EVENT)
+        len += CapOptLen(clen);
+    if (CapReserve(c, len) < 0)
+        return -1;
+
+    uint32_t epb[7] = { PCAPNG_EPB, len, ifid, r->ts >> 32, (uint32_t)r->ts,
+                        caplen, caplen };
+    CapPut(c, epb, sizeof(epb));
+    CapPut(c, data, caplen);
+    CapPad(c, caplen);
+    if (flags)
+        CapOpt(c, EPB_FLAGS, &flags, 4);
+    if (r->type == CAP_EVENT)
+        CapOpt(c, OPT_COMMENT, r->ev, clen); // readable in Wireshark
+    CapPut32(c, OPT_END);
+    CapPut32(c, len);
+    return 0;
+}
+
+static int CapPop(tCapture *c, tCapRec *r)
+{
+    tCapCell *cell = &c->cell[c->deq & CAP_MASK];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+
+    if (seq != c->deq + 1)
+        return -1;
+    *r = cell->r;
+    atomic_store_explicit(&cell->seq, c->deq + CAP_SIZE, memory_order_release);
+    c->deq++;
+    return 0;
+}
+
+// Only this thread touches the file, a slow disk stalls nobody else
+static void *CapThread(void *ptr)
+{
+    tCapture *c = ptr;
+    tCapRec r;
+    struct timespec idle = { 0, 2000000 };
+
+    for (;;) {
+        int n = 0;
+        while (CapPop(c, &r) == 0) {
+            if (CapWriteRec(c, &r) < 0) {
+                perror("capture write");
+                atomic_store(&c->stop, 1);
+                break;
+            }
+            n++;
+        }
+        if (n == 0) {
+            if (atomic_load(&c->stop))
+                break;
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+tCapture *CapOpen(const char *path, int nbus, const char **ifnames)
+{
+    tCapture *c = aligned_alloc(64, sizeof(tCapture));
+
+    if (!c)
+        return NULL;
+    memset(c, 0, sizeof(*c));
+    for (size_t i = 0; i < CAP_SIZE; i++)
+        atomic_init(&c->cell[i].seq, i);
+    c->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (c->fd < 0 || CapHeader(c, nbus, ifnames) < 0 ||
+        pthread_create(&c->th, NULL, CapThread, c) != 0) {
+        perror(path);
+        if (c->map)
+            munmap(c->map, CAP_MAP);
+        if (c->fd >= 0)
+            close(c->fd);
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+// Writes out what is left and cuts the file to its real size
+void CapClose(tCapture *c)
+{
+    if (!c)
+        return;
+    atomic_store(&c->stop, 1);
+    pthread_join(c->th, NULL);
+    if (c->map)
+        munmap(c->map, CAP_MAP);
+    if (ftruncate(c->fd, c->off) < 0)
+        perror("capture truncate");
+    close(c->fd);
+    printf("capture %llu bytes, %llu records dropped\n",
+           (unsigned long long)c->off,
+           (unsigned long long)atomic_load(&c->drops));
+    free(c);
+}
+
+static void CapPush(tCapture *c, const tCapRec *r)
+{
+    size_t pos = atomic_load_explicit(&c->enq, memory_order_relaxed);
+    tCapCell *cell;
+
+    for (;;) {
+        cell = &c->cell[pos & CAP_MASK];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&c->enq, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            atomic_fetch_add_explicit(&c->drops, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&c->enq, memory_order_relaxed);
+        }
+    }
+    cell->r = *r;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+}
+
+// ts 0 stamps the record now
+void CapFrame(tCapture *c, int bus, int type, const tCanFrame *f, int mtu,
+              uint64_t ts)
+{
+    tCapRec r;
+
+    r.ts = ts ? ts : CapNow();
+    r.type = type;
+    r.bus = bus;
+    r.mtu = mtu;
+    memcpy(&r.frame, f, mtu);
+    if (mtu == CAN_MTU)
+        memset(r.frame.data + CAN_DATA_SIZE, 0, CANFD_DATA_SIZE - CAN_DATA_SIZE);
+    CapPush(c, &r);
+}
+
+void CapEvent(tCapture *c, int bus, const char *fmt, ...)
+{
+    tCapRec r;
+    va_list ap;
+
+    r.ts = CapNow();
+    r.type = CAP_EVENT;
+    r.bus = bus;
+    r.mtu = 0;
+    va_start(ap, fmt);
+    vsnprintf(r.ev, sizeof(r.ev), fmt, ap);
+    va_end(ap);
+    CapPush(c, &r);
+}
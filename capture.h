@@ -0,0 +1,60 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "cansock.h"
+
+// Records held in memory until the writer gets to them, power of two
+#define CAP_SIZE (8192)
+
+// Record types
+enum {
+    CAP_RX = 0, // frame from the bus
+    CAP_TX, // frame written to the bus
+    CAP_EVENT // port or pty event, text in ev
+};
+
+typedef struct {
+    uint64_t ts; // CLOCK_REALTIME, ns
+    uint8_t type;
+    uint8_t bus;
+    uint8_t mtu; // CAN_MTU or CANFD_MTU for frames
+    union {
+        tCanFrame frame;
+        char ev[CANFD_MTU];
+    };
+} tCapRec;
+
+typedef struct {
+    atomic_size_t seq;
+    tCapRec r;
+} tCapCell;
+
+// Any thread appends without blocking, a background thread writes the
+// records to an mmap'd pcapng file. Records that find the ring full
+// are counted and lost.
+typedef struct {
+    _Alignas(64) atomic_size_t enq;
+    _Alignas(64) atomic_size_t deq; // writer only
+    _Alignas(64) _Atomic uint64_t drops;
+    atomic_int stop;
+    pthread_t th;
+    int fd;
+    uint8_t *map; // current window of the file
+    uint64_t mapoff; // file offset of map
+    uint64_t off; // end of data in the file
+    tCapCell cell[CAP_SIZE];
+} tCapture;
+
+tCapture *CapOpen(const char *path, int nbus, const char **ifnames);
+void      CapClose(tCapture *c);
+void      CapFrame(tCapture *c, int bus, int type, const tCanFrame *f,
+                   int mtu, uint64_t ts);
+void      CapEvent(tCapture *c, int bus, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#endif /* CAPTURE_H_ */
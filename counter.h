@@ -0,0 +1,35 @@
+#ifndef COUNTER_H_
+#define COUNTER_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Statistics counter with a single writing thread. Updates are plain
+// relaxed load and store, no locked instruction, and any thread may
+// read them. Counters of one writer are grouped in a cache line aligned
+// struct so the readers never bounce a hot line of another thread.
+typedef _Atomic uint64_t tCounter;
+
+static inline void CntAdd(tCounter *c, uint64_t n)
+{
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static inline void CntMax(tCounter *c, uint64_t v)
+{
+    if (v > atomic_load_explicit(c, memory_order_relaxed))
+        atomic_store_explicit(c, v, memory_order_relaxed);
+}
+
+static inline void CntSet(tCounter *c, uint64_t v)
+{
+    atomic_store_explicit(c, v, memory_order_relaxed);
+}
+
+static inline uint64_t CntGet(const tCounter *c)
+{
+    return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+#endif /* COUNTER_H_ */
@@ -0,0 +1,95 @@
+/*
+ * Lock-free latency histograms for CanSerial
+ *
+ *  This file may be distributed under the terms of the GNU GPLv3 license.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "histo.h"
+
+static unsigned HistoBucket(uint64_t v)
+{
+    if (v < HISTO_SUB)
+        return v;
+    int msb = 63 - __builtin_clzll(v);
+    unsigned major = msb - HISTO_SUB_BITS + 1;
+    unsigned idx = major * HISTO_SUB +
+        ((v >> (msb - HISTO_SUB_BITS)) & (HISTO_SUB - 1));
+    return idx < HISTO_BUCKETS ? idx : HISTO_BUCKETS - 1;
+}
+
+// Highest value falling into bucket idx
+static uint64_t HistoUpper(unsigned idx)
+{
+    if (idx < HISTO_SUB)
+        return idx;
+    unsigned major = idx / HISTO_SUB;
+    uint64_t sub = idx % HISTO_SUB;
+    return ((HISTO_SUB + sub + 1) << (major - 1)) - 1;
+}
+
+void HistoReset(tHisto *h)
+{
+    for (int i = 0; i < HISTO_BUCKETS; i++)
+        atomic_store_explicit(&h->count[i], 0, memory_order_relaxed);
+    atomic_store_explicit(&h->total, 0, memory_order_relaxed);
+    atomic_store_explicit(&h->max, 0, memory_order_relaxed);
+}
+
+void HistoRecord(tHisto *h, uint64_t ns)
+{
+    atomic_fetch_add_explicit(&h->count[HistoBucket(ns)], 1,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->total, 1, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (ns > max &&
+           !atomic_compare_exchange_weak_explicit(&h->max, &max, ns,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed))
+        ;
+}
+
+uint64_t HistoCount(const tHisto *h)
+{
+    return atomic_load_explicit(&h->total, memory_order_relaxed);
+}
+
+// Upper bound of the bucket holding quantile q (0..1), 0 if empty.
+// Counters keep moving while we read, the result is approximate.
+uint64_t HistoPercentile(const tHisto *h, double q)
+{
+    uint64_t total = HistoCount(h);
+    uint64_t seen = 0;
+
+    if (total == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(q * total);
+    if (rank >= total)
+        rank = total - 1;
+    for (unsigned i = 0; i < HISTO_BUCKETS; i++) {
+        seen += atomic_load_explicit(&h->count[i], memory_order_relaxed);
+        if (seen > rank) {
+            uint64_t max = atomic_load_explicit(&h->max,
+                                                memory_order_relaxed);
+            uint64_t up = HistoUpper(i);
+            return up < max ? up : max;
+        }
+    }
+    return atomic_load_explicit(&h->max, memory_order_relaxed);
+}
+
+void HistoPrint(FILE *f, const char *name, const tHisto *h)
+{
+    if (HistoCount(h) == 0)
+        return;
+    fprintf(f, "%s n %llu p50 %llu us p99 %llu us p99.9 %llu us max %llu us\n",
+            name, (unsigned long long)HistoCount(h),
+            (unsigned long long)(HistoPercentile(h, 0.5) / 1000),
+            (unsigned long long)(HistoPercentile(h, 0.99) / 1000),
+            (unsigned long long)(HistoPercentile(h, 0.999) / 1000),
+            (unsigned long long)(atomic_load_explicit(&h->max,
+                                 memory_order_relaxed) / 1000));
+}
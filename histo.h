@@ -0,0 +1,30 @@
+#ifndef HISTO_H_
+#define HISTO_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Log-linear latency histogram in ns: exact below HISTO_SUB, above that
+// every power of two is split into HISTO_SUB buckets (12.5% resolution).
+// Values beyond the last bucket (~17 s) are clamped into it.
+#define HISTO_SUB_BITS 3
+#define HISTO_SUB (1 << HISTO_SUB_BITS)
+#define HISTO_MAJOR 32
+#define HISTO_BUCKETS (HISTO_MAJOR * HISTO_SUB)
+
+// Any thread may record, no locks. Cache line aligned so histograms
+// written by different threads never share a line.
+typedef struct {
+    _Alignas(64) atomic_uint count[HISTO_BUCKETS];
+    _Atomic uint64_t total;
+    _Atomic uint64_t max;
+} tHisto;
+
+void     HistoReset(tHisto *h);
+void     HistoRecord(tHisto *h, uint64_t ns);
+uint64_t HistoCount(const tHisto *h);
+uint64_t HistoPercentile(const tHisto *h, double q);
+void     HistoPrint(FILE *f, const char *name, const tHisto *h);
+
+#endif /* HISTO_H_ */
@@ -10,6 +10,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <net/if.h>
 
 #include "cansock.h"
 #include "portnumber.h"
@@ -17,19 +20,100 @@
 #define CONFIG_LINE_BUFFER_SIZE 64
 #define CONFIG_FILENAME "/var/tmp/canuuids.cfg"
 
+// Registry file and its temporary twin for snapshots
+static char cfgname[256] = CONFIG_FILENAME;
+static char tmpname[260];
+
 typedef struct {
 	uint16_t port;
 	uint8_t uuid[CAN_UUID_SIZE];
+	char bus[IFNAMSIZ]; // where the node was seen last
 } tPnKeep;
 
+// Ports of all busses share one registry
+static pthread_mutex_t pnlock = PTHREAD_MUTEX_INITIALIZER;
+// Held while the file is written, never together with pnlock
+static pthread_mutex_t snaplock = PTHREAD_MUTEX_INITIALIZER;
+static int pn_dirty = 0;
 static int pn_len = 0;
 static int max_pn = 0;
+// Every port number the CAN ID space has room for, allocated once so
+// nothing grows while the bridge runs
+#define PN_MAX (CAN_MAX_PORT + 1)
 static tPnKeep *dict;
+static tPnKeep *snap; // copy of dict that PnSync writes out
+
+// Open addressing indexes into dict by UUID and by port, slots hold
+// dict index + 1 so zero is empty. Power of two, at most half full.
+#define PN_IDXSIZE 8192
+static int *uuididx;
+static int *portidx;
+static const uint32_t idxsize = PN_IDXSIZE;
+
+// Port numbers handed out are 1..pn_ports, minus those in pn_resv whose
+// CAN IDs are taken by the handshake
+static int pn_ports = CAN_MAX_PORT;
+static uint8_t pn_resv[CAN_MAX_PORT + 1];
+
+// Priority classes of the ID map. Each gets an equal block of the port
+// numbers, lower classes lower numbers and so lower CAN IDs, which win
+// arbitration on the bus.
+#define PN_CLASSES 4
+#define PN_NORMAL 1 // nodes the map does not list
+static const char *const pn_classes[PN_CLASSES] = {
+	"motion", "normal", "sensor", "low"
+};
+
+// ID map entry, class and optionally a fixed port of one node
+typedef struct {
+	uint8_t used;
+	uint8_t cls;
+	uint16_t pin; // 0 for any port of the class
+	uint8_t uuid[CAN_UUID_SIZE];
+} tPnMap;
+
+// Open addressing by UUID like uuididx, NULL without a map
+static tPnMap *pnmap;
+static uint8_t pn_pinned[CAN_MAX_PORT + 1];
+
+static uint64_t uuidkey(const uint8_t *u)
+{
+	uint64_t k = 0;
+	for (int i=0; i<CAN_UUID_SIZE; i++)
+		k = (k << 8) | u[i];
+	return k;
+}
+
+static uint32_t hash64(uint64_t k)
+{
+	// murmur3 finalizer
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return (uint32_t)k;
+}
+
+// Slot of u in uuididx, either holding it or the empty one to insert at
+static uint32_t uuidslot(const uint8_t *u)
+{
+	uint32_t h = hash64(uuidkey(u)) & (idxsize - 1);
+	while (uuididx[h] &&
+			memcmp(dict[uuididx[h] - 1].uuid, u, CAN_UUID_SIZE) != 0)
+		h = (h + 1) & (idxsize - 1);
+	return h;
+}
 
-// power of two
-static int dictsize = 2;
+static uint32_t portslot(uint16_t p)
+{
+	uint32_t h = hash64(p) & (idxsize - 1);
+	while (portidx[h] && dict[portidx[h] - 1].port != p)
+		h = (h + 1) & (idxsize - 1);
+	return h;
+}
 
-static void printuuid(FILE* stream, uint8_t *u)
+static void printuuid(FILE* stream, const uint8_t *u)
 {
 	int i;
 	for (i=0; i< CAN_UUID_SIZE; i++) {
@@ -39,105 +123,382 @@ static void printuuid(FILE* stream, uint8_t *u)
 	}
 }
 
-static void addnum(uint16_t p, uint8_t *u)
+// Map entry of u or the empty one to insert at
+static tPnMap *mapslot(const uint8_t *u)
 {
-	if(pn_len+1 >= dictsize) {
-		// Increase allocated space
-		dictsize *= 2;
-		dict = realloc(dict, sizeof(tPnKeep) * dictsize);
-		if (!dict) {
-			fprintf(stderr, "realloc failed!\n");
-			exit(1);
-		}
+	uint32_t h = hash64(uuidkey(u)) & (idxsize - 1);
+	while (pnmap[h].used && memcmp(pnmap[h].uuid, u, CAN_UUID_SIZE) != 0)
+		h = (h + 1) & (idxsize - 1);
+	return &pnmap[h];
+}
+
+// Ports whose number changed, port 0 entries have none
+static void reindex(void)
+{
+	memset(portidx, 0, idxsize * sizeof(int));
+	for (int i=0; i<pn_len; i++) {
+		if (dict[i].port)
+			portidx[portslot(dict[i].port)] = i + 1;
+	}
+}
+
+static void classrange(const uint8_t *u, int *lo, int *hi)
+{
+	const tPnMap *m = mapslot(u);
+	int cls = m->used ? m->cls : PN_NORMAL;
+
+	*lo = 1 + cls * pn_ports / PN_CLASSES;
+	*hi = (cls + 1) * pn_ports / PN_CLASSES;
+	if (*lo > *hi) {
+		// fewer ports than classes
+		*lo = 1;
+		*hi = pn_ports;
+	}
+}
+
+// Whether u may keep port p
+static int pnfits(const uint8_t *u, int p)
+{
+	int lo, hi;
+
+	if (pnmap && mapslot(u)->pin)
+		return p == mapslot(u)->pin;
+	if (p < 1 || p > pn_ports || pn_resv[p] || pn_pinned[p])
+		return 0;
+	if (!pnmap)
+		return 1;
+	classrange(u, &lo, &hi);
+	return p >= lo && p <= hi;
+}
+
+static int pnfree(int p)
+{
+	return !pn_resv[p] && !pn_pinned[p] && !portidx[portslot(p)];
+}
+
+static int pnpick(const uint8_t *u);
+
+// A node pinned to p takes it over from whoever had it
+static void pnevict(int p, const uint8_t *u)
+{
+	int i = portidx[portslot(p)];
+
+	if (!i || memcmp(dict[i - 1].uuid, u, CAN_UUID_SIZE) == 0)
+		return;
+	tPnKeep *k = &dict[i - 1];
+	k->port = 0;
+	reindex();
+	k->port = pnpick(k->uuid);
+	reindex();
+	printf("Port %d is pinned, ", p);
+	printuuid(stdout, k->uuid);
+	printf(" moved to %d\n", k->port);
+}
+
+// Port number for u, 0 if none is left. Without a map in arrival order
+// as ever, with one the lowest free in the class of u.
+static int pnpick(const uint8_t *u)
+{
+	int lo = 1, hi = pn_ports, start;
+
+	if (pnmap && mapslot(u)->pin) {
+		pnevict(mapslot(u)->pin, u);
+		return mapslot(u)->pin;
+	}
+	if (pnmap)
+		classrange(u, &lo, &hi);
+	start = pnmap || max_pn >= hi ? lo : max_pn + 1;
+	if (start < lo)
+		start = lo;
+	for (int p = start; p <= hi; p++) {
+		if (pnfree(p))
+			return p;
 	}
+	for (int p = lo; p < start; p++) {
+		if (pnfree(p))
+			return p;
+	}
+	return 0;
+}
 
+// Returns 0 if added, -1 for a duplicate port or UUID or a port
+// outside the CAN ID space
+static int addnum(uint16_t p, uint8_t *u, const char *bus)
+{
+	if (p > CAN_MAX_PORT || pn_len == PN_MAX) {
+		printf("Port %d out of range\n", p);
+		return -1;
+	}
 	// Check duplicates
-	for (int i=0; i<pn_len; i++) {
-		if (dict[i].port == p ||
-				memcmp(dict[i].uuid, u, CAN_UUID_SIZE) == 0) {
-			printf("Duplicate port %d\n", p);
-			return;
-		}
+	uint32_t us = uuidslot(u);
+	uint32_t ps = portslot(p);
+	if (uuididx[us] || portidx[ps]) {
+		printf("Duplicate port %d\n", p);
+		return -1;
 	}
 
 	memcpy(dict[pn_len].uuid, u, CAN_UUID_SIZE);
 	dict[pn_len].port = p;
-	//printf("port %d ", p);
-	//printuuid(stdout, u);
-	//printf("\n");
+	snprintf(dict[pn_len].bus, IFNAMSIZ, "%s", bus);
 	pn_len++;
+	uuididx[us] = pn_len;
+	portidx[ps] = pn_len;
 
 	// max port for automatic allocation
 	if(max_pn<p) max_pn = p;
+	return 0;
+}
+
+// Rewrite the whole registry through a temporary file, so a crash leaves
+// either the old or the new one in place
+static void PnSnapshot(const tPnKeep *d, int n)
+{
+	FILE *fp;
+
+	if ((fp=fopen(tmpname, "w")) == NULL) {
+		perror(tmpname);
+		return;
+	}
+	fprintf(fp,"# [port] [UUID] [bus]\n");
+	for (int i=0; i<n; i++) {
+		if (!d[i].port)
+			continue; // lost its port to a pinned node, none left
+		fprintf(fp,"%d ",d[i].port);
+		printuuid(fp, d[i].uuid);
+		fprintf(fp," %s\n", d[i].bus);
+	}
+	if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+		perror(tmpname);
+		fclose(fp);
+		unlink(tmpname);
+		return;
+	}
+	fclose(fp);
+	if (rename(tmpname, cfgname) != 0) {
+		perror(cfgname);
+		unlink(tmpname);
+	}
 }
 
-void PnInit(void)
+// path NULL for the default registry
+void PnInit(const char *path)
 {
 	FILE *fp;
 	char buf[CONFIG_LINE_BUFFER_SIZE];
+	int stale = 0;
 
-	dict = malloc(sizeof(tPnKeep) * dictsize);
-	if (!dict) {
-		fprintf(stderr, "malloc failed!\n");
+	// Every bridge instance of the process shares the registry
+	if (dict)
+		return;
+	if (path)
+		snprintf(cfgname, sizeof(cfgname), "%s", path);
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", cfgname);
+	dict = calloc(PN_MAX, sizeof(tPnKeep));
+	snap = calloc(PN_MAX, sizeof(tPnKeep));
+	uuididx = calloc(idxsize, sizeof(int));
+	portidx = calloc(idxsize, sizeof(int));
+	if (!dict || !snap || !uuididx || !portidx) {
+		fprintf(stderr, "calloc failed!\n");
 		exit(1);
 	}
 
-    if (fp=fopen(CONFIG_FILENAME, "r")) {
-        while(fgets(buf, CONFIG_LINE_BUFFER_SIZE, fp) > 0) {
+    if ((fp=fopen(cfgname, "r")) != NULL) {
+        while(fgets(buf, CONFIG_LINE_BUFFER_SIZE, fp) != NULL) {
             if (buf[0] == '#' || strlen(buf) < 4) {
                 continue;
             }
             int p = atoi(buf);
             char c[10];
             uint8_t u[CAN_UUID_SIZE] = {0};
-            if (sscanf(buf, "%s %hhx:%hhx:%hhx:%hhx:%hhx:%hhx\n",
-                    c, &(u[0]), &(u[1]), &(u[2]), &(u[3]), &(u[4]), &(u[5])) == 7) {
-                addnum(p,u);
+            // Registries from before multi bus support have no bus
+            // column, all their nodes were on can0
+            char bus[IFNAMSIZ] = "can0";
+            int n = sscanf(buf, "%9s %hhx:%hhx:%hhx:%hhx:%hhx:%hhx %15s\n",
+                    c, &(u[0]), &(u[1]), &(u[2]), &(u[3]), &(u[4]), &(u[5]),
+                    bus);
+            if (n == 7 || n == 8) {
+                if (addnum(p,u,bus) != 0 || n == 7)
+                    stale = 1;
             } else {
                 printf("Wrong format %s\n", buf);
+                stale = 1;
             }
         }
         fclose(fp);
+        // Compact: drop duplicates and broken lines left by older versions
+        if (stale)
+            PnSnapshot(dict, pn_len);
     } else {
         // First run
-        if ((fp=fopen(CONFIG_FILENAME, "w")) != NULL) {
-            fprintf(fp,"# [port] [UUID]\n");
-            fclose(fp);
-        } else {
-	    perror(CONFIG_FILENAME);
-	}
+        PnSnapshot(dict, pn_len);
     }
 }
 
-void PnStore(int port, uint8_t* u)
+// Write the registry out if it changed. The copy is taken under pnlock,
+// the slow write and fsync happen without it so lookups never wait.
+void PnSync(void)
 {
-	FILE *fp;
+	int n;
 
-	if ((fp=fopen(CONFIG_FILENAME, "a")) != NULL) {
-		fprintf(fp,"%d ",port);
-		printuuid(fp, u);
-		fprintf(fp,"\n");
-		fclose(fp);
-	} else {
-		perror("Can't store config " CONFIG_FILENAME);
+	pthread_mutex_lock(&snaplock);
+	pthread_mutex_lock(&pnlock);
+	n = pn_dirty ? pn_len : -1;
+	if (n >= 0)
+		memcpy(snap, dict, n * sizeof(tPnKeep));
+	pn_dirty = 0;
+	pthread_mutex_unlock(&pnlock);
+	if (n >= 0)
+		PnSnapshot(snap, n);
+	pthread_mutex_unlock(&snaplock);
+}
+
+// Copy known port numbers and optionally their UUIDs, of the nodes last
+// seen on bus or of all nodes for a NULL bus. Returns their count.
+int PnPorts(const char *bus, uint16_t *ports,
+		uint8_t (*uuids)[CAN_UUID_SIZE], int max)
+{
+	int n = 0;
+
+	pthread_mutex_lock(&pnlock);
+	for (int i=0; i<pn_len && n<max; i++) {
+		if (bus && strcmp(bus, dict[i].bus) != 0)
+			continue;
+		// gets another number when it answers
+		if (!pnfits(dict[i].uuid, dict[i].port))
+			continue;
+		if (uuids)
+			memcpy(uuids[n], dict[i].uuid, CAN_UUID_SIZE);
+		ports[n++] = dict[i].port;
 	}
+	pthread_mutex_unlock(&pnlock);
+	return n;
 }
 
-uint16_t PnGetNumber(uint8_t* u)
+// Port of u, a new one if unknown, -1 once all port numbers are taken.
+// A known node whose number no longer fits the range or its class in
+// the ID map is moved. Only memory is touched, PnSync persists it.
+int PnGetNumber(uint8_t* u, const char *bus)
 {
-	for (int i=0; i<pn_len; i++) {
-		if (memcmp(dict[i].uuid, u, CAN_UUID_SIZE) == 0) {
-			return dict[i].port;
+	int port;
+	int i;
+
+	pthread_mutex_lock(&pnlock);
+	if ((i = uuididx[uuidslot(u)]) != 0) {
+		tPnKeep *k = &dict[i - 1];
+		if (!pnfits(u, k->port)) {
+			int old = k->port;
+			k->port = 0;
+			reindex();
+			k->port = pnpick(u);
+			reindex();
+			if (max_pn < k->port)
+				max_pn = k->port;
+			printf("Address ");
+			printuuid(stdout, u);
+			printf(" moved from port %d to %d\n", old, k->port);
+			pn_dirty = 1;
+		}
+		port = k->port;
+		if (strcmp(k->bus, bus) != 0) {
+			// Node moved to another bus, warm starts follow it
+			snprintf(k->bus, IFNAMSIZ, "%s", bus);
+			pn_dirty = 1;
 		}
+		pthread_mutex_unlock(&pnlock);
+		return port ? port : -1;
 	}
 	// not found, keep num in dict
-	addnum(max_pn+1,u);
+	port = pnpick(u);
+	if (port == 0 || addnum(port,u,bus) != 0) {
+		pthread_mutex_unlock(&pnlock);
+		return -1;
+	}
 	printf("Address ");
 	printuuid(stdout, u);
-	printf(" not found in config, assigned port %d\n", max_pn);
-	PnStore(max_pn, u);
+	printf(" not found in config, assigned port %d\n", port);
+	pn_dirty = 1;
+	pthread_mutex_unlock(&pnlock);
+
+	return port;
+}
 
-	return max_pn; // already incremented value in previous call
+// Hand out ports 1..nports only, at most CAN_MAX_PORT
+void PnRange(int nports)
+{
+	pthread_mutex_lock(&pnlock);
+	pn_ports = nports < CAN_MAX_PORT ? nports : CAN_MAX_PORT;
+	pthread_mutex_unlock(&pnlock);
 }
 
+// Never hand out port, its CAN IDs are used otherwise
+void PnReserve(uint16_t port)
+{
+	if (port > CAN_MAX_PORT)
+		return;
+	pthread_mutex_lock(&pnlock);
+	pn_resv[port] = 1;
+	pthread_mutex_unlock(&pnlock);
+}
 
+static int pnclass(const char *name)
+{
+	for (int c=0; c<PN_CLASSES; c++) {
+		if (strcmp(name, pn_classes[c]) == 0)
+			return c;
+	}
+	if (name[0] >= '0' && name[0] < '0' + PN_CLASSES && !name[1])
+		return name[0] - '0';
+	return -1;
+}
+
+// Load the ID map, lines of "<uuid> <class> [port]" with class one of
+// motion, normal, sensor, low or 0..3. Call after PnRange and PnReserve,
+// the first map loaded stays. Returns -1 for a missing or broken file.
+int PnLoadMap(const char *path)
+{
+	FILE *fp;
+	char buf[CONFIG_LINE_BUFFER_SIZE];
+	int res = 0, line = 0;
+
+	pthread_mutex_lock(&pnlock);
+	if (pnmap) {
+		pthread_mutex_unlock(&pnlock);
+		return 0;
+	}
+	if ((fp=fopen(path, "r")) == NULL ||
+	    (pnmap = calloc(idxsize, sizeof(tPnMap))) == NULL) {
+		perror(path);
+		if (fp)
+			fclose(fp);
+		pthread_mutex_unlock(&pnlock);
+		return -1;
+	}
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		uint8_t u[CAN_UUID_SIZE];
+		char cls[16];
+		int pin = 0;
+
+		line++;
+		if (buf[0] == '#' || strspn(buf, " \t\r\n") == strlen(buf))
+			continue;
+		int n = sscanf(buf, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx %15s %d",
+				&u[0], &u[1], &u[2], &u[3], &u[4], &u[5], cls, &pin);
+		int c = n >= 7 ? pnclass(cls) : -1;
+		tPnMap *m = mapslot(u);
+		if (c < 0 || m->used || (n == 8 && (pin < 1 || pin > pn_ports ||
+				pn_resv[pin] || pn_pinned[pin]))) {
+			fprintf(stderr, "%s:%d: bad or duplicate entry\n", path, line);
+			res = -1;
+			continue;
+		}
+		m->used = 1;
+		m->cls = c;
+		m->pin = n == 8 ? pin : 0;
+		memcpy(m->uuid, u, CAN_UUID_SIZE);
+		if (m->pin)
+			pn_pinned[m->pin] = 1;
+	}
+	fclose(fp);
+	pthread_mutex_unlock(&pnlock);
+	return res;
+}
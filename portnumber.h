@@ -1,8 +1,14 @@
 #ifndef PORTNUMBER_H_
 #define PORTNUMBER_H_
 
-void PnInit(void);
-uint16_t PnGetNumber(uint8_t* uuid);
+void PnInit(const char *path);
+void PnRange(int nports);
+void PnReserve(uint16_t port);
+int PnLoadMap(const char *path);
+int PnGetNumber(uint8_t* uuid, const char *bus);
+int PnPorts(const char *bus, uint16_t *ports,
+		uint8_t (*uuids)[CAN_UUID_SIZE], int max);
+void PnSync(void);
 
 
 #endif /* PORTNUMBER_H_ */
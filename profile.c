@@ -0,0 +1,55 @@
+/*
+ * Per-stage cycle accounting for CanSerial
+ *
+ *  This file may be distributed under the terms of the GNU GPLv3 license.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "profile.h"
+
+static uint64_t ProfRawNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void ProfClockStart(tProfClock *c)
+{
+    c->ns = ProfRawNs();
+    c->ticks = ProfTicks();
+}
+
+double ProfClockHz(const tProfClock *c)
+{
+    uint64_t ns = ProfRawNs();
+    uint64_t ticks = ProfTicks();
+
+    // Right after the start the rate is mostly noise
+    if (ns - c->ns < 10000000ULL) {
+        struct timespec wait = { 0, 10000000L - (long)(ns - c->ns) };
+        nanosleep(&wait, NULL);
+        ns = ProfRawNs();
+        ticks = ProfTicks();
+    }
+    return (double)(ticks - c->ticks) * 1e9 / (double)(ns - c->ns);
+}
+
+void ProfPrint(FILE *f, const char *name, const tProfile *p,
+               const char *const *stages, int n, double hz, uint64_t up)
+{
+    for (int i = 0; i < n && i < PROF_MAX; i++) {
+        uint64_t cnt = CntGet(&p->count[i]);
+        uint64_t ticks = CntGet(&p->ticks[i]);
+        if (cnt == 0)
+            continue;
+        fprintf(f, "%s %s n %llu cycles %llu avg %.2f us total %.1f ms "
+                "%.1f%%\n", name, stages[i], (unsigned long long)cnt,
+                (unsigned long long)ticks, ticks / hz / cnt * 1e6,
+                ticks / hz * 1e3, up ? 100.0 * ticks / up : 0);
+    }
+}
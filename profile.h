@@ -0,0 +1,50 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "counter.h"
+
+// Time spent per stage by one thread, in ticks of ProfTicks: the TSC
+// on x86, CLOCK_MONOTONIC_RAW ns elsewhere. Only the owning thread
+// adds, any thread may print.
+#define PROF_MAX 16
+
+typedef struct {
+    _Alignas(64) tCounter ticks[PROF_MAX];
+    tCounter count[PROF_MAX];
+} tProfile;
+
+// Where ticks and ns started, to tell the tick rate later
+typedef struct {
+    uint64_t ticks;
+    uint64_t ns;
+} tProfClock;
+
+static inline uint64_t ProfTicks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline void ProfAdd(tProfile *p, int stage, uint64_t ticks)
+{
+    CntAdd(&p->ticks[stage], ticks);
+    CntAdd(&p->count[stage], 1);
+}
+
+void   ProfClockStart(tProfClock *c);
+// Ticks per second since ProfClockStart
+double ProfClockHz(const tProfClock *c);
+// One line per stage that ran, its share of the up ticks since start
+void   ProfPrint(FILE *f, const char *name, const tProfile *p,
+                 const char *const *stages, int n, double hz, uint64_t up);
+
+#endif /* PROFILE_H_ */
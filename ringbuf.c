@@ -0,0 +1,173 @@
+/*
+ * Byte ring buffers for CanSerial
+ *
+ *  This file may be distributed under the terms of the GNU GPLv3 license.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#include "ringbuf.h"
+
+#define RING_MASK (RING_SIZE - 1)
+
+// Touches every page, so with locked memory nothing faults later
+int RbPoolInit(tRingPool *pl, int n)
+{
+    pl->rings = aligned_alloc(RING_ALIGN, n * sizeof(tRing));
+    pl->free = malloc(n * sizeof(tRing *));
+    pl->nfree = 0;
+    if (!pl->rings || !pl->free) {
+        RbPoolFree(pl);
+        return -1;
+    }
+    memset(pl->rings, 0, n * sizeof(tRing));
+    // Hand out the lowest addresses first
+    for (int i = n - 1; i >= 0; i--)
+        pl->free[pl->nfree++] = &pl->rings[i];
+    return 0;
+}
+
+void RbPoolFree(tRingPool *pl)
+{
+    free(pl->rings);
+    free(pl->free);
+    pl->rings = NULL;
+    pl->free = NULL;
+    pl->nfree = 0;
+}
+
+// NULL when all rings are taken
+tRing *RbGet(tRingPool *pl)
+{
+    if (pl->nfree == 0)
+        return NULL;
+    tRing *r = pl->free[--pl->nfree];
+    r->head = r->tail = r->hiwater = 0;
+    r->drops = 0;
+    return r;
+}
+
+void RbRelease(tRingPool *pl, tRing *r)
+{
+    if (r)
+        pl->free[pl->nfree++] = r;
+}
+
+uint32_t RbUsed(const tRing *r)
+{
+    return r->head - r->tail;
+}
+
+// Store all len bytes or nothing, a partial frame would corrupt
+// the serial stream worse than a lost one
+int RbPut(tRing *r, const uint8_t *data, uint32_t len)
+{
+    uint32_t used = RbUsed(r);
+
+    if (len > RING_SIZE - used) {
+        r->drops += len;
+        return -1;
+    }
+
+    uint32_t pos = r->head & RING_MASK;
+    uint32_t first = RING_SIZE - pos;
+    if (first > len)
+        first = len;
+    memcpy(r->buf + pos, data, first);
+    memcpy(r->buf, data + first, len - first);
+    r->head += len;
+
+    used += len;
+    if (used > r->hiwater)
+        r->hiwater = used;
+    return 0;
+}
+
+// Write out as much as fd accepts. Returns bytes left in the ring
+// or -1 on a hard error, in that case the content is dropped.
+int RbDrain(tRing *r, int fd)
+{
+    while (RbUsed(r)) {
+        struct iovec iov[2];
+        uint32_t used = RbUsed(r);
+        uint32_t pos = r->tail & RING_MASK;
+        uint32_t first = RING_SIZE - pos;
+        int cnt = 1;
+
+        if (first >= used) {
+            first = used;
+        } else {
+            iov[1].iov_base = r->buf;
+            iov[1].iov_len = used - first;
+            cnt = 2;
+        }
+        iov[0].iov_base = r->buf + pos;
+        iov[0].iov_len = first;
+
+        ssize_t w = writev(fd, iov, cnt);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                break;
+            r->drops += RbUsed(r);
+            r->tail = r->head;
+            return -1;
+        }
+        r->tail += w;
+    }
+    return RbUsed(r);
+}
+
+static void RbCopyOut(const tRing *r, uint32_t at, uint8_t *data, uint32_t len)
+{
+    uint32_t pos = at & RING_MASK;
+    uint32_t first = RING_SIZE - pos;
+    if (first > len)
+        first = len;
+    memcpy(data, r->buf + pos, first);
+    memcpy(data + first, r->buf, len - first);
+}
+
+// Store one record as length byte plus data, all or nothing
+int RbPutRec(tRing *r, const uint8_t *data, uint8_t len)
+{
+    if ((uint32_t)len + 1 > RING_SIZE - RbUsed(r)) {
+        r->drops += len;
+        return -1;
+    }
+    RbPut(r, &len, 1);
+    return RbPut(r, data, len);
+}
+
+// Send one datagram per record as long as fd accepts them. Returns bytes
+// left in the ring or -1 on a hard error, the content is dropped then.
+int RbDrainRec(tRing *r, int fd)
+{
+    uint8_t rec[256];
+
+    while (RbUsed(r)) {
+        uint8_t len = r->buf[r->tail & RING_MASK];
+        RbCopyOut(r, r->tail + 1, rec, len);
+
+        ssize_t w = send(fd, rec, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                break;
+            r->drops += RbUsed(r);
+            r->tail = r->head;
+            return -1;
+        }
+        r->tail += len + 1;
+    }
+    return RbUsed(r);
+}
@@ -0,0 +1,36 @@
+#ifndef RINGBUF_H_
+#define RINGBUF_H_
+
+#include <stdint.h>
+
+// Size of per-port byte ring, must be power of two
+#define RING_SIZE (4096)
+#define RING_ALIGN (64)
+
+typedef struct {
+    uint32_t head; // write position
+    uint32_t tail; // read position
+    uint32_t hiwater; // max fill level seen
+    uint64_t drops; // bytes lost because the ring was full
+    uint8_t buf[RING_SIZE];
+} __attribute__((aligned(RING_ALIGN))) tRing;
+
+// Rings of one bus, all allocated at startup. Single threaded.
+typedef struct {
+    tRing *rings;
+    tRing **free;
+    int nfree;
+} tRingPool;
+
+int      RbPoolInit(tRingPool *pl, int n);
+void     RbPoolFree(tRingPool *pl);
+tRing   *RbGet(tRingPool *pl);
+void     RbRelease(tRingPool *pl, tRing *r);
+uint32_t RbUsed(const tRing *r);
+int      RbPut(tRing *r, const uint8_t *data, uint32_t len);
+int      RbDrain(tRing *r, int fd);
+// Record mode keeps message boundaries for datagram sockets
+int      RbPutRec(tRing *r, const uint8_t *data, uint8_t len);
+int      RbDrainRec(tRing *r, int fd);
+
+#endif /* RINGBUF_H_ */
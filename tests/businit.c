@@ -0,0 +1,117 @@
+/*
+ * CanSockInit on a bus whose TX thread fails to start
+ *
+ * The RX thread of the bus is already running by then, it has to be
+ * stopped and every fd of the bus closed before the context is handed
+ * out. pthread_create is wrapped (-Wl,--wrap=pthread_create) to fail the
+ * TX thread, threads and fds are counted before and after.
+ *
+ * Needs a CAN interface, vcan0 or $CANTEST_IF, exits 77 (skipped)
+ * without one.
+ *
+ *  This file may be distributed under the terms of the GNU GPLv3 license.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+
+#include "cansock.h"
+
+#define SKIP 77
+
+// Control worker, RX thread, then the TX thread of the first bus
+static int failat = 3;
+static int calls;
+
+int __real_pthread_create(pthread_t *th, const pthread_attr_t *attr,
+                          void *(*fn)(void *), void *arg);
+
+int __wrap_pthread_create(pthread_t *th, const pthread_attr_t *attr,
+                          void *(*fn)(void *), void *arg)
+{
+    if (++calls == failat)
+        return EAGAIN;
+    return __real_pthread_create(th, attr, fn, arg);
+}
+
+static int DirCount(const char *path)
+{
+    DIR *d = opendir(path);
+    int n = 0;
+    if (!d)
+        return -1;
+    while (readdir(d))
+        n++;
+    closedir(d);
+    return n;
+}
+
+int main(void)
+{
+    const char *ifname = getenv("CANTEST_IF");
+    if (!ifname)
+        ifname = "vcan0";
+    int s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    if (s < 0 || if_nametoindex(ifname) == 0) {
+        printf("no CAN interface %s, skipped\n", ifname);
+        return SKIP;
+    }
+    close(s);
+
+    char registry[] = "/tmp/businitXXXXXX";
+    int rfd = mkstemp(registry);
+    if (rfd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(rfd);
+
+    tCanCfg cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.nbus = 1;
+    cfg.ifname[0] = ifname;
+    cfg.cpu[0] = -1;
+    cfg.pty = 1;
+    cfg.ptypool = 0;
+    cfg.registry = registry;
+
+    int fds = DirCount("/proc/self/fd");
+    int tasks = DirCount("/proc/self/task");
+
+    tCanCtx *ctx = NULL;
+    int retval = CanSockInit(&cfg, &ctx);
+    int failed = 0;
+    if (retval != EAGAIN) {
+        fprintf(stderr, "CanSockInit returned %d, expected EAGAIN\n", retval);
+        failed = 1;
+    }
+    if (calls < failat) {
+        fprintf(stderr, "only %d threads started, TX was never tried\n",
+                calls);
+        failed = 1;
+    }
+    CanSockClose(ctx);
+
+    int fds2 = DirCount("/proc/self/fd");
+    int tasks2 = DirCount("/proc/self/task");
+    if (fds2 != fds) {
+        fprintf(stderr, "%d fds open before, %d after\n", fds, fds2);
+        failed = 1;
+    }
+    if (tasks2 != tasks) {
+        fprintf(stderr, "%d threads before, %d after\n", tasks, tasks2);
+        failed = 1;
+    }
+    unlink(registry);
+    return failed;
+}
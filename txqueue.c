@@ -0,0 +1,133 @@
+/*
+ * Lock-free TX frame queue for CanSerial
+ *
+ *  This file may be distributed under the terms of the GNU GPLv3 license.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+
+#include "txqueue.h"
+
+#define TXQ_MASK (TXQ_SIZE - 1)
+
+int TxqInit(tTxQueue *q)
+{
+    atomic_init(&q->enq, 0);
+    atomic_init(&q->deq, 0);
+    atomic_init(&q->sleeping, 0);
+    for (size_t i = 0; i < TXQ_SIZE; i++)
+        atomic_init(&q->cell[i].seq, i);
+    q->wakefd = eventfd(0, EFD_CLOEXEC);
+    return q->wakefd < 0 ? -1 : 0;
+}
+
+// Fill a cell claimed at pos and wake the consumer if it sleeps
+static void TxqStore(tTxQueue *q, size_t pos, tTxEntry *e)
+{
+    tTxCell *cell = &q->cell[pos & TXQ_MASK];
+
+    e->seq = pos;
+    cell->e = *e;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+    // Consumer went to sleep, kick it. Pairs with the fence in TxqWait:
+    // either we see sleeping or the consumer sees our entry.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&q->sleeping, memory_order_relaxed))
+        TxqKick(q);
+}
+
+// Returns -1 when the queue is full, never blocks
+int TxqPush(tTxQueue *q, tTxEntry *e)
+{
+    size_t pos;
+
+    if (TxqReserve(q, 1, &pos) < 0)
+        return -1;
+    TxqStore(q, pos, e);
+    return 0;
+}
+
+// Claim n cells in a row, all or nothing, never blocks. The consumer
+// frees cells in order, so once the last one is free all are.
+int TxqReserve(tTxQueue *q, size_t n, size_t *ppos)
+{
+    size_t pos = atomic_load_explicit(&q->enq, memory_order_relaxed);
+
+    if (n == 0 || n > TXQ_SIZE)
+        return -1;
+    for (;;) {
+        size_t last = pos + n - 1;
+        tTxCell *cell = &q->cell[last & TXQ_MASK];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)last;
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->enq, &pos, pos + n,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (dif < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&q->enq, memory_order_relaxed);
+        }
+    }
+    *ppos = pos;
+    return 0;
+}
+
+// Fill the i-th cell of a reservation. Every cell reserved must be
+// filled, the consumer stops at the first one that is not.
+void TxqPut(tTxQueue *q, size_t pos, size_t i, tTxEntry *e)
+{
+    TxqStore(q, pos + i, e);
+}
+
+// Consumer side, returns -1 when empty
+int TxqPop(tTxQueue *q, tTxEntry *e)
+{
+    size_t pos = atomic_load_explicit(&q->deq, memory_order_relaxed);
+    tTxCell *cell = &q->cell[pos & TXQ_MASK];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+
+    if ((intptr_t)seq - (intptr_t)(pos + 1) < 0)
+        return -1;
+    *e = cell->e;
+    atomic_store_explicit(&q->deq, pos + 1, memory_order_relaxed);
+    atomic_store_explicit(&cell->seq, pos + TXQ_SIZE, memory_order_release);
+    return 0;
+}
+
+size_t TxqDepth(tTxQueue *q)
+{
+    return atomic_load_explicit(&q->enq, memory_order_relaxed) -
+        atomic_load_explicit(&q->deq, memory_order_relaxed);
+}
+
+// Block the consumer until something is pushed or TxqKick is called
+void TxqWait(tTxQueue *q)
+{
+    uint64_t cnt;
+
+    atomic_store_explicit(&q->sleeping, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (TxqDepth(q) == 0) {
+        if (read(q->wakefd, &cnt, sizeof(cnt)) < 0 && errno != EINTR)
+            perror("TxqWait");
+    }
+    atomic_store(&q->sleeping, 0);
+}
+
+void TxqKick(tTxQueue *q)
+{
+    uint64_t one = 1;
+
+    atomic_store(&q->sleeping, 0);
+    if (write(q->wakefd, &one, sizeof(one)) < 0)
+        perror("TxqKick");
+}
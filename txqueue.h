@@ -0,0 +1,62 @@
+#ifndef TXQUEUE_H_
+#define TXQUEUE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "cansock.h"
+#include "histo.h"
+#include "counter.h"
+
+// Queue size, must be power of two
+#define TXQ_SIZE (1024)
+
+// Frame classes in transmit order
+enum {
+    TXC_CONTROL = 0, // address assignment and UUID requests
+    TXC_DATA,
+    TXC_PING
+};
+
+// Accounting of one sender, written by the TX thread only
+typedef struct {
+    _Alignas(64) tCounter frames; // written to the bus
+    tCounter bytes;
+    tHisto lat; // from reading the data until it was on the bus
+} tTxAcct;
+
+typedef struct {
+    tCanFrame frame;
+    uint8_t mtu; // CAN_MTU or CANFD_MTU
+    uint8_t cls;
+    uint64_t seq; // queue order, keeps FIFO within one CAN ID
+    uint64_t queued; // enqueue time, ns
+    uint64_t born; // when the data was read from the host, ns
+    tTxAcct *acct; // sender to account the frame to, or NULL
+} tTxEntry;
+
+typedef struct {
+    atomic_size_t seq;
+    tTxEntry e;
+} tTxCell;
+
+// Bounded lock-free queue, any number of producers, one consumer
+typedef struct {
+    _Alignas(64) atomic_size_t enq;
+    _Alignas(64) atomic_size_t deq;
+    _Alignas(64) atomic_int sleeping; // consumer waits on wakefd
+    int wakefd;
+    tTxCell cell[TXQ_SIZE];
+} tTxQueue;
+
+int    TxqInit(tTxQueue *q);
+int    TxqPush(tTxQueue *q, tTxEntry *e);
+int    TxqReserve(tTxQueue *q, size_t n, size_t *pos);
+void   TxqPut(tTxQueue *q, size_t pos, size_t i, tTxEntry *e);
+int    TxqPop(tTxQueue *q, tTxEntry *e);
+size_t TxqDepth(tTxQueue *q);
+void   TxqWait(tTxQueue *q);
+void   TxqKick(tTxQueue *q);
+
+#endif /* TXQUEUE_H_ */
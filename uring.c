@@ -0,0 +1,238 @@
+/*
+ * io_uring without liburing for CanSerial
+ *
+ *  This file may be distributed under the terms of the GNU GPLv3 license.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "uring.h"
+
+static int UrSetup(unsigned entries, struct io_uring_params *p)
+{
+    int fd = syscall(__NR_io_uring_setup, entries, p);
+    return fd < 0 ? -errno : fd;
+}
+
+static int UrEnter(int fd, unsigned submit, unsigned wait, unsigned flags,
+                   void *arg, size_t argsz)
+{
+    int r = syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+    return r < 0 ? -errno : r;
+}
+
+static int UrRegister(int fd, unsigned op, void *arg, unsigned n)
+{
+    int r = syscall(__NR_io_uring_register, fd, op, arg, n);
+    return r < 0 ? -errno : r;
+}
+
+int UrInit(tUring *u, unsigned entries, unsigned cqentries)
+{
+    // Only the creating thread submits. Completion work then runs when
+    // it enters the kernel instead of interrupting it, where the kernel
+    // knows how; older ones get the plain setup.
+    static const unsigned tries[] = {
+        IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+        IORING_SETUP_COOP_TASKRUN,
+        0
+    };
+    struct io_uring_params p;
+    int fd = -EINVAL;
+
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+    for (size_t i = 0; i < sizeof(tries) / sizeof(tries[0]); i++) {
+        memset(&p, 0, sizeof(p));
+        p.flags = tries[i] | IORING_SETUP_CQSIZE;
+        p.cq_entries = cqentries;
+        fd = UrSetup(entries, &p);
+        if (fd != -EINVAL)
+            break;
+    }
+    if (fd < 0)
+        return fd;
+    u->fd = fd;
+    u->features = p.features;
+
+    u->sqmaplen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cqmaplen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cqmaplen > u->sqmaplen)
+            u->sqmaplen = u->cqmaplen;
+        u->cqmaplen = u->sqmaplen;
+    }
+    u->sqmap = mmap(NULL, u->sqmaplen, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (u->sqmap == MAP_FAILED) {
+        u->sqmap = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cqmap = u->sqmap;
+    } else {
+        u->cqmap = mmap(NULL, u->cqmaplen, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (u->cqmap == MAP_FAILED) {
+            u->cqmap = NULL;
+            goto fail;
+        }
+    }
+    u->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqeslen, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto fail;
+    }
+
+    uint8_t *sq = u->sqmap, *cq = u->cqmap;
+    u->sqhead = (_Atomic unsigned *)(sq + p.sq_off.head);
+    u->sqktail = (_Atomic unsigned *)(sq + p.sq_off.tail);
+    u->sqmask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    u->sqarray = (unsigned *)(sq + p.sq_off.array);
+    u->cqhead = (_Atomic unsigned *)(cq + p.cq_off.head);
+    u->cqtail = (_Atomic unsigned *)(cq + p.cq_off.tail);
+    u->cqmask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    // SQE i always sits in array slot i
+    for (unsigned i = 0; i <= u->sqmask; i++)
+        u->sqarray[i] = i;
+    u->sqtail = atomic_load_explicit(u->sqktail, memory_order_relaxed);
+    return 0;
+
+fail:
+    fd = -errno;
+    UrExit(u);
+    return fd;
+}
+
+void UrExit(tUring *u)
+{
+    if (u->br)
+        munmap(u->br, u->brlen);
+    if (u->sqes)
+        munmap(u->sqes, u->sqeslen);
+    if (u->cqmap && u->cqmap != u->sqmap)
+        munmap(u->cqmap, u->cqmaplen);
+    if (u->sqmap)
+        munmap(u->sqmap, u->sqmaplen);
+    if (u->fd >= 0)
+        close(u->fd);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+struct io_uring_sqe *UrSqe(tUring *u)
+{
+    unsigned head = atomic_load_explicit(u->sqhead, memory_order_acquire);
+
+    if (u->sqtail - head > u->sqmask)
+        return NULL;
+    struct io_uring_sqe *sqe = &u->sqes[u->sqtail++ & u->sqmask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+unsigned UrSpace(tUring *u)
+{
+    return u->sqmask + 1 -
+        (u->sqtail - atomic_load_explicit(u->sqhead, memory_order_acquire));
+}
+
+int UrSubmit(tUring *u, unsigned wait, uint64_t timeout_ns)
+{
+    unsigned submit = u->sqtail -
+        atomic_load_explicit(u->sqhead, memory_order_acquire);
+    // Always GETEVENTS, deferred completion work runs only then
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    struct __kernel_timespec ts = { timeout_ns / 1000000000ULL,
+                                    timeout_ns % 1000000000ULL };
+    struct io_uring_getevents_arg arg = { 0, 0, 0, (uintptr_t)&ts };
+    void *argp = NULL;
+    size_t argsz = 0;
+
+    atomic_store_explicit(u->sqktail, u->sqtail, memory_order_release);
+    if (wait && timeout_ns && (u->features & IORING_FEAT_EXT_ARG)) {
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argsz = sizeof(arg);
+    }
+    int r = UrEnter(u->fd, submit, wait, flags, argp, argsz);
+    // Running into the timeout or a signal is not an error here
+    if (r == -ETIME || r == -EINTR)
+        r = 0;
+    return r;
+}
+
+struct io_uring_cqe *UrPeek(tUring *u)
+{
+    unsigned head = atomic_load_explicit(u->cqhead, memory_order_relaxed);
+
+    if (head == atomic_load_explicit(u->cqtail, memory_order_acquire))
+        return NULL;
+    return &u->cqes[head & u->cqmask];
+}
+
+void UrSeen(tUring *u)
+{
+    unsigned head = atomic_load_explicit(u->cqhead, memory_order_relaxed);
+    atomic_store_explicit(u->cqhead, head + 1, memory_order_release);
+}
+
+int UrRegisterBuf(tUring *u, void *base, size_t len)
+{
+    struct iovec iov = { base, len };
+    return UrRegister(u->fd, IORING_REGISTER_BUFFERS, &iov, 1);
+}
+
+int UrBufRing(tUring *u, uint8_t *bufs, unsigned n, unsigned size)
+{
+    struct io_uring_buf_reg reg;
+
+    u->brlen = n * sizeof(struct io_uring_buf);
+    u->br = mmap(NULL, u->brlen, PROT_READ | PROT_WRITE,
+                 MAP_ANONYMOUS | MAP_PRIVATE | MAP_POPULATE, -1, 0);
+    if (u->br == MAP_FAILED) {
+        u->br = NULL;
+        return -errno;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)u->br;
+    reg.ring_entries = n;
+    reg.bgid = 0;
+    int r = UrRegister(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+    if (r < 0) {
+        munmap(u->br, u->brlen);
+        u->br = NULL;
+        return r;
+    }
+    u->brmask = n - 1;
+    u->brtail = 0;
+    for (unsigned i = 0; i < n; i++)
+        UrBufPut(u, bufs + i * size, size, i);
+    return 0;
+}
+
+// Hand a buffer back to the kernel once its completion is dealt with
+void UrBufPut(tUring *u, uint8_t *buf, unsigned size, uint16_t bid)
+{
+    struct io_uring_buf *e = &u->br->bufs[u->brtail & u->brmask];
+
+    e->addr = (uintptr_t)buf;
+    e->len = size;
+    e->bid = bid;
+    u->brtail++;
+    atomic_store_explicit((_Atomic uint16_t *)&u->br->tail, u->brtail,
+                          memory_order_release);
+}
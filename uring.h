@@ -0,0 +1,50 @@
+#ifndef URING_H_
+#define URING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring through the raw syscalls, one submitting thread.
+// SQEs are taken with UrSqe and go to the kernel with the next
+// UrSubmit, completions are read with UrPeek and UrSeen.
+typedef struct {
+    int fd;
+    unsigned features; // IORING_FEAT_*
+    unsigned sqmask, cqmask;
+    unsigned sqtail; // local, published by UrSubmit
+    _Atomic unsigned *sqhead, *sqktail;
+    _Atomic unsigned *cqhead, *cqtail;
+    unsigned *sqarray;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqmap, *cqmap;
+    size_t sqmaplen, cqmaplen, sqeslen;
+    // Provided buffers of UrBufRing, group 0
+    struct io_uring_buf_ring *br;
+    size_t brlen;
+    unsigned brmask;
+    uint16_t brtail;
+} tUring;
+
+// 0 or -errno, the kernel may lack io_uring or have it disabled
+int  UrInit(tUring *u, unsigned entries, unsigned cqentries);
+void UrExit(tUring *u);
+// Zeroed SQE, NULL while the SQ is full
+struct io_uring_sqe *UrSqe(tUring *u);
+// SQEs UrSqe still hands out before the next UrSubmit
+unsigned UrSpace(tUring *u);
+// Submit everything taken and wait for at least wait completions, for
+// at most timeout_ns when wait is set. Always enters the kernel, that
+// is where completions are posted. Returns SQEs consumed or -errno.
+int  UrSubmit(tUring *u, unsigned wait, uint64_t timeout_ns);
+struct io_uring_cqe *UrPeek(tUring *u);
+void UrSeen(tUring *u);
+// Fixed buffer index 0, for IORING_OP_WRITE_FIXED
+int  UrRegisterBuf(tUring *u, void *base, size_t len);
+// n buffers of size bytes each as group 0, n a power of two
+int  UrBufRing(tUring *u, uint8_t *bufs, unsigned n, unsigned size);
+void UrBufPut(tUring *u, uint8_t *buf, unsigned size, uint16_t bid);
+
+#endif /* URING_H_ */